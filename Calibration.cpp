@@ -26,6 +26,7 @@ SOFTWARE.
 #include "statistics.h"
 #include "ScannerReflFix.h"
 #include "validation.h"
+#include "DebugDump.h"
 
 using std::vector;
 using std::array;
@@ -69,7 +70,7 @@ bool ScanCalibration::load(string cal_tif_file, const vector<float>& neutrals_fo
 	// now with gamma estimate get linear, downsampled square info at 50dpi
 	for (int i = 0; i < 14; i++)
 	{
-		Array2D<float> sq200 = image.extract(extants[i].top - 1, extants[i].bottom - extants[i].top + 2,
+		auto sq200 = image.view(extants[i].top - 1, extants[i].bottom - extants[i].top + 2,
 			extants[i].left - 1, extants[i].right - extants[i].left + 2);
 		Array2D<float> sq100 = downsample(sq200, 2);
 		squares_50dpi[i] = downsample(sq100, 2);
@@ -98,8 +99,7 @@ bool ScanCalibration::load(string cal_tif_file, const vector<float>& neutrals_fo
 // the series of small, stepped gray, patches.
 float ScanCalibration::update_square_data(bool update_gamma, const vector<float>& neutrals_for_gamma) {
 	// get dark areas
-	Array2D<float> da=image.extract(10, 20, 10, 20);
-	dark = accumulate(da.v.begin(), da.v.end(),0.0f)/400.0f;
+	dark = image.view(10, 20, 10, 20).ave();
 
 	auto iround =[](float f){return static_cast<int>(f+.5f);};
 	for (size_t n = 0; n < locs.size(); n++)
@@ -143,7 +143,7 @@ float ScanCalibration::update_square_data(bool update_gamma, const vector<float>
 		
 		// trim 10 pixels around edges to minimize refraction losses
 		Array2D<float>::Extants sqr={extants[n].top+10, extants[n].bottom-10,extants[n].left+10,extants[n].right-10};
-		Array2D<float> g = image.clip(sqr);
+		auto g = image.clip_view(sqr);
 		refl[n].ave = g.ave();
 		int offset_limit = std::min(g.nr, g.nc)/2-2;
 		refl[n].slice.resize(offset_limit);
@@ -306,7 +306,7 @@ tuple<float, Array2D<float>*>  ScanCalibration::get_patch_area(Patch2 patch,  Ar
 // get average 3.0" white patch center values for maximum re-reflection
 float ScanCalibration::get_patch13(float gain)
 {
-	auto inner_ave = squares_50dpi[13].extract(50, 50, 50, 50).ave();
+	auto inner_ave = squares_50dpi[13].view(50, 50, 50, 50).ave();
 	return inner_ave - (exp(inner_ave*gain)-1);
 }
 
@@ -339,8 +339,8 @@ float ScanCalibration::calibration_quality(bool zero_gain) {
 		if (options.save_intermediate_files) printf("%6.4f\n", get<0>(xxx));
 		for (int i = 0; i < square.weight && square.square!=0; i++)
 			patches.clk(get<0>(xxx));
-		string s="sq_"; s += std::to_string(square.square)+".txt";
-		if (options.save_intermediate_files) get<1>(xxx)->print(s, false);
+		string s="sq_"; s += std::to_string(square.square)+".npy";
+		if (options.save_intermediate_files) dump_npy(s, Array2D<float>(*get<1>(xxx)));
 	}
 	float std = patches.std();
 	printf("%s %7.5f\n", zero_gain? "Uncorrected reflection rms err" : "Corrected reflection rms err", 255*std);
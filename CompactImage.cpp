@@ -0,0 +1,152 @@
+/*
+Copyright (c) <2020> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+#include "CompactImage.h"
+
+namespace {
+
+// IEEE half from float, rounded to nearest even
+uint16_t float_to_half(float f)
+{
+    uint32_t x;
+    std::memcpy(&x, &f, sizeof(x));
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t absx = x & 0x7fffffff;
+    if (absx >= 0x7f800000)                 // inf or nan
+        return uint16_t(sign | (absx > 0x7f800000 ? 0x7e00 : 0x7c00));
+    if (absx >= 0x477ff000)                 // 65520 and up round to inf
+        return uint16_t(sign | 0x7c00);
+    if (absx < 0x38800000)                  // half subnormal, multiples of 2^-24
+    {
+        float a;
+        std::memcpy(&a, &absx, sizeof(a));
+        return uint16_t(sign | uint32_t(std::nearbyint(a * 16777216.0f)));
+    }
+    uint32_t rebiased = absx - 0x38000000;  // exponent bias 127 to 15
+    return uint16_t(sign | ((rebiased + 0x0fff + ((rebiased >> 13) & 1)) >> 13));
+}
+
+float half_to_float(uint16_t h)
+{
+    uint32_t sign = uint32_t(h & 0x8000) << 16;
+    uint32_t e = (h >> 10) & 0x1f;
+    uint32_t m = h & 0x3ff;
+    if (e == 0)
+    {
+        float f = std::ldexp(float(m), -24);
+        return sign ? -f : f;
+    }
+    uint32_t x = sign | (e == 31 ? 0x7f800000 : (e + 112) << 23) | (m << 13);
+    float f;
+    std::memcpy(&f, &x, sizeof(f));
+    return f;
+}
+
+// Float value of every uint16 or half code
+const std::vector<float>& decode_lut(CompactImage::Kind kind)
+{
+    auto make = [](CompactImage::Kind kind) {
+        std::vector<float> lut(65536);
+        for (uint32_t i = 0; i < lut.size(); i++)
+            lut[i] = kind == CompactImage::Kind::half ? half_to_float(uint16_t(i)) : i / 65535.0f;
+        return lut;
+    };
+    static const std::vector<float> lut16 = make(CompactImage::Kind::uint16);
+    static const std::vector<float> luthalf = make(CompactImage::Kind::half);
+    return kind == CompactImage::Kind::half ? luthalf : lut16;
+}
+
+}
+
+bool CompactImage::parse(const std::string& name, Kind& kind)
+{
+    if (name == "16")
+        kind = Kind::uint16;
+    else if (name == "half")
+        kind = Kind::half;
+    else
+        return false;
+    return true;
+}
+
+CompactImage::CompactImage(const ArrayRGB& format, Kind kind) : fmt(format), kind(kind)
+{
+    fmt.resize(0, 0);
+    fmt.nr = format.nr;
+    fmt.nc = format.nc;
+    fmt.pitch = format.nc;
+    for (auto& x : v)
+        x.resize(size_t(fmt.nr) * fmt.nc);
+}
+
+void CompactImage::store(int first_row, const ArrayRGB& band)
+{
+    if (first_row < 0 || first_row + band.nr > fmt.nr || band.nc != fmt.nc)
+        throw std::invalid_argument("CompactImage store out of range");
+    auto pack = [this, first_row, &band](int color) {
+        uint16_t* to = &v[color][size_t(first_row) * fmt.nc];
+        for (int r = 0; r < band.nr; r++, to += fmt.nc)
+        {
+            const float* from = band.row(r, color);
+            if (kind == Kind::half)
+                for (int c = 0; c < band.nc; c++)
+                    to[c] = float_to_half(from[c]);
+            else
+                for (int c = 0; c < band.nc; c++)
+                    to[c] = uint16_t(std::clamp(from[c], 0.0f, 1.0f) * 65535.0f + 0.5f);
+        }
+    };
+    auto c0 = std::async(launchType, pack, 0);
+    auto c1 = std::async(launchType, pack, 1);
+    auto c2 = std::async(launchType, pack, 2);
+    c0.get(); c1.get(); c2.get();
+}
+
+void CompactImage::load(int first_row, int rows, ArrayRGB& band) const
+{
+    if (first_row < 0 || first_row + rows > fmt.nr)
+        throw std::invalid_argument("CompactImage load out of range");
+    band.resize(rows, fmt.nc);
+    band.dpi = fmt.dpi;
+    band.gamma = fmt.gamma;
+    band.from_16bits = fmt.from_16bits;
+    band.from_float = fmt.from_float;
+    const std::vector<float>& lut = decode_lut(kind);
+    auto unpack = [this, first_row, &band, &lut](int color) {
+        const uint16_t* from = &v[color][size_t(first_row) * fmt.nc];
+        for (int r = 0; r < band.nr; r++, from += fmt.nc)
+        {
+            float* to = band.row(r, color);
+            for (int c = 0; c < band.nc; c++)
+                to[c] = lut[from[c]];
+        }
+    };
+    auto c0 = std::async(launchType, unpack, 0);
+    auto c1 = std::async(launchType, unpack, 1);
+    auto c2 = std::async(launchType, unpack, 2);
+    c0.get(); c1.get(); c2.get();
+}
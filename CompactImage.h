@@ -0,0 +1,50 @@
+/*
+Copyright (c) <2020> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef COMPACTIMAGE_H
+#define COMPACTIMAGE_H
+
+#include <cstdint>
+#include <string>
+#include "tiffresults.h"
+
+// Full resolution image held in 2 bytes a sample instead of a float, -Q. Linear values
+// after the LUT decode are kept either as 16 bit integers, 0 to 1 in 65535 steps, or
+// as IEEE half floats, which keep more shadow precision and values over 1 from float
+// tifs. Rows are converted to and from float a band at a time so all arithmetic, and
+// the reduced and working images, stay float.
+class CompactImage {
+public:
+    enum class Kind { uint16, half };
+    static bool parse(const std::string& name, Kind& kind);    // "16" or "half"
+    CompactImage(const ArrayRGB& format, Kind kind);            // size and context of format, no pixels
+    const ArrayRGB& format() const { return fmt; }
+    void store(int first_row, const ArrayRGB& band);            // pack band's rows starting at first_row
+    void load(int first_row, int rows, ArrayRGB& band) const;   // unpack rows into band, resized as TiffRowReader::read()
+    size_t bytes() const { return v[0].size() * sizeof(uint16_t) * 3; }
+private:
+    ArrayRGB fmt;
+    Kind kind;
+    aligned_vector<uint16_t> v[3];
+};
+
+#endif
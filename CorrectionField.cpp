@@ -0,0 +1,92 @@
+/*
+Copyright (c) <2020> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include "CorrectionField.h"
+#include "validation.h"
+
+using std::string;
+using std::ios;
+
+static const char field_magic[8] = { 'S','R','F','F','I','E','L','D' };
+static const uint32_t field_version = 1;
+
+void CorrectionField::write(const string& filename) const
+{
+    std::ofstream out(filename, ios::binary);
+    validate(!out.fail(), "Correction field file could not be opened: " + filename);
+    auto put = [&out](const auto& x) { out.write(reinterpret_cast<const char*>(&x), sizeof(x)); };
+    out.write(field_magic, sizeof(field_magic));
+    put(field_version);
+    put(int32_t(image_nr)); put(int32_t(image_nc)); put(int32_t(image_dpi)); put(int32_t(reduction));
+    put(gamma); put(edge_reflectance); put(calibration_hash);
+    put(int32_t(field.nr)); put(int32_t(field.nc)); put(int32_t(field.dpi));
+    for (const auto& plane : field.v)
+        out.write(reinterpret_cast<const char*>(plane.data()), plane.size() * sizeof(float));
+    validate(!out.fail(), "Error writing correction field file: " + filename);
+}
+
+void CorrectionField::read(const string& filename)
+{
+    std::ifstream in(filename, ios::binary);
+    validate(!in.fail(), "Correction field file could not be opened: " + filename);
+    auto get = [&in](auto& x) { in.read(reinterpret_cast<char*>(&x), sizeof(x)); };
+    char magic[8];
+    uint32_t version;
+    int32_t nr, nc, dpi, red, fnr, fnc, fdpi;
+    in.read(magic, sizeof(magic));
+    get(version);
+    validate(!in.fail() && std::equal(magic, magic + 8, field_magic) && version == field_version,
+        "Not a correction field file: " + filename);
+    get(nr); get(nc); get(dpi); get(red);
+    get(gamma); get(edge_reflectance); get(calibration_hash);
+    get(fnr); get(fnc); get(fdpi);
+    validate(!in.fail() && fnr > 0 && fnc > 0 && fdpi > 0 && red > 0, "Corrupt correction field file: " + filename);
+    // the three planes must be in the file before they are allocated
+    auto header_end = in.tellg();
+    in.seekg(0, ios::end);
+    auto planes_bytes = in.tellg() - header_end;
+    in.seekg(header_end);
+    validate(uint64_t(fnr) * uint64_t(fnc) * 3 * sizeof(float) <= uint64_t(planes_bytes), "Truncated correction field file: " + filename);
+    image_nr = nr; image_nc = nc; image_dpi = dpi; reduction = red;
+    field = ArrayRGB(fnr, fnc, fdpi, true, gamma);
+    for (auto& plane : field.v)
+        in.read(reinterpret_cast<char*>(plane.data()), plane.size() * sizeof(float));
+    validate(!in.fail(), "Truncated correction field file: " + filename);
+}
+
+// A saved field is only valid for the same image size, dpi, decode gamma, -S and calibration file
+void CorrectionField::check_matches(const ArrayRGB& image, uint64_t cal_hash, float edge_refl) const
+{
+    validate(image.nr == image_nr && image.nc == image_nc && image.dpi == image_dpi,
+        "Correction field was made from an image with a different size or dpi");
+    // bilinear() reads up to the field row and column of the last image pixel, the next one is clamped
+    validate(field.dpi > 0 && reduction == image_dpi / field.dpi
+        && field.nr >= (image_nr - 1) / reduction + 1 && field.nc >= (image_nc - 1) / reduction + 1,
+        "Corrupt correction field, its size doesn't match the image");
+    validate(std::abs(image.gamma - gamma) < 1e-4f, "Correction field was made with a different gamma (-A)");
+    validate(std::abs(edge_refl - edge_reflectance) < 1e-6f, "Correction field was made with a different edge reflectance (-S)");
+    validate(cal_hash == calibration_hash, "Correction field was made with a different calibration file (-C)");
+}
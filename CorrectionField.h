@@ -0,0 +1,54 @@
+/*
+Copyright (c) <2020> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef CORRECTIONFIELD_H
+#define CORRECTIONFIELD_H
+
+#include <string>
+#include <cstdint>
+#include "tiffresults.h"
+
+// Low resolution re-reflected light estimate for one scanned image.
+// This is the output of the expensive convolution and depends only on the
+// image, the calibration file, the decode gamma and the edge reflectance so it
+// can be saved and re-applied with different -N, -P, -F, -W or -R settings.
+//
+// File layout (.rcf), little endian:
+//   char[8] "SRFFIELD", uint32 version,
+//   int32 image_nr, image_nc, image_dpi, reduction,
+//   float gamma, edge_reflectance, uint64 calibration_hash,
+//   int32 field nr, nc, dpi, then float R, G, B planes of nr*nc values
+struct CorrectionField {
+    ArrayRGB field;                 // reflected light gain at reduced dpi, 0 for no correction
+    int image_nr{};                 // full resolution image size the field was made from
+    int image_nc{};
+    int image_dpi{};
+    int reduction{};                // full resolution dpi / field dpi
+    float gamma{};                  // gamma used to linearize the tif image
+    float edge_reflectance{};       // -S value used for the 1" surround
+    uint64_t calibration_hash{};    // InterpolateRefl::file_hash of the calibration file
+    void write(const std::string& filename) const;
+    void read(const std::string& filename);       // throws if missing or corrupt
+    void check_matches(const ArrayRGB& image, uint64_t cal_hash, float edge_refl) const;  // throws if not usable
+};
+
+#endif
@@ -0,0 +1,182 @@
+/*
+Copyright (c) <2020> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _CRT_SECURE_NO_WARNINGS
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <iostream>
+#include "DebugDump.h"
+
+using std::string;
+using std::vector;
+
+// Single worker thread running queued writes in order. With DISABLE_ASYNC_THREADS
+// writes are made immediately.
+class DumpQueue {
+    std::mutex m;
+    std::condition_variable has_work, idle;
+    std::deque<std::function<void()>> jobs;
+    bool busy = false;
+    bool done = false;
+    std::thread worker;
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        for (;;)
+        {
+            has_work.wait(lock, [this] { return done || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            auto job = std::move(jobs.front());
+            jobs.pop_front();
+            busy = true;
+            lock.unlock();
+            job();
+            lock.lock();
+            busy = false;
+            if (jobs.empty())
+                idle.notify_all();
+        }
+    }
+public:
+    DumpQueue() : worker(&DumpQueue::run, this) {}
+    ~DumpQueue()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            done = true;
+        }
+        has_work.notify_one();
+        worker.join();
+    }
+    void push(std::function<void()> job)
+    {
+#ifdef DISABLE_ASYNC_THREADS
+        job();
+#else
+        {
+            std::lock_guard<std::mutex> lock(m);
+            jobs.push_back(std::move(job));
+        }
+        has_work.notify_one();
+#endif
+    }
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(m);
+        idle.wait(lock, [this] { return jobs.empty() && !busy; });
+    }
+};
+
+static DumpQueue& dump_queue()
+{
+    static DumpQueue queue;
+    return queue;
+}
+
+// npy version 1.0 header, padded so the data starts on a 64 byte boundary
+static string npy_header(const string& shape)
+{
+    string dict = "{'descr': '<f4', 'fortran_order': False, 'shape': (" + shape + "), }";
+    size_t len = 10 + dict.size() + 1;
+    dict.append((64 - len % 64) % 64, ' ');
+    dict += '\n';
+    string ret("\x93NUMPY\x01\x00", 8);
+    ret += char(dict.size() & 0xff);
+    ret += char(dict.size() >> 8);
+    return ret + dict;
+}
+
+static FILE* open_npy(const string& filename, const string& shape)
+{
+    FILE* fp = fopen(filename.c_str(), "wb");
+    string header = npy_header(shape);
+    if (fp && fwrite(header.data(), 1, header.size(), fp) != header.size())
+    {
+        fclose(fp);
+        fp = nullptr;
+    }
+    if (!fp)
+        std::cerr << "Could not write " << filename << "\n";   // from the writer thread, so not in a job's log
+    return fp;
+}
+
+// R, G, B planes interleaved as (nr, nc, 3), a row at a time
+static void write_interleaved(FILE* fp, const ArrayRGB& a)
+{
+    vector<float> row(size_t(3) * a.nc);
+    for (int r = 0; r < a.nr; r++)
+    {
+        for (int color = 0; color < 3; color++)
+            for (int c = 0; c < a.nc; c++)
+                row[3 * c + color] = a(r, c, color);
+        fwrite(row.data(), sizeof(float), row.size(), fp);
+    }
+}
+
+void dump_npy(const string& filename, Array2D<float>&& a)
+{
+    auto data = std::make_shared<Array2D<float>>(std::move(a));
+    dump_queue().push([filename, data] {
+        FILE* fp = open_npy(filename, std::to_string(data->nr) + ", " + std::to_string(data->nc));
+        if (!fp)
+            return;
+        fwrite(data->v.data(), sizeof(float), data->v.size(), fp);
+        fclose(fp);
+    });
+}
+
+void dump_npy(const string& filename, ArrayRGB&& a)
+{
+    auto data = std::make_shared<ArrayRGB>(std::move(a));
+    dump_queue().push([filename, data] {
+        FILE* fp = open_npy(filename, std::to_string(data->nr) + ", " + std::to_string(data->nc) + ", 3");
+        if (!fp)
+            return;
+        write_interleaved(fp, *data);
+        fclose(fp);
+    });
+}
+
+void wait_for_dumps()
+{
+    dump_queue().wait();
+}
+
+NpyRowWriter::NpyRowWriter(const string& filename, int nr, int nc)
+{
+    string shape = std::to_string(nr) + ", " + std::to_string(nc) + ", 3";
+    this->file = std::shared_ptr<FILE>(open_npy(filename, shape), [](FILE* fp) { if (fp) fclose(fp); });
+}
+
+void NpyRowWriter::write(ArrayRGB&& band)
+{
+    auto data = std::make_shared<ArrayRGB>(std::move(band));
+    auto fp = file;
+    dump_queue().push([fp, data] {
+        if (fp)
+            write_interleaved(fp.get(), *data);
+    });
+}
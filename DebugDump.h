@@ -0,0 +1,48 @@
+/*
+Copyright (c) <2020> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef DEBUGDUMP_H
+#define DEBUGDUMP_H
+
+#include <string>
+#include <memory>
+#include <cstdio>
+#include "array2d.h"
+#include "tiffresults.h"
+
+// -I intermediate arrays are saved as numpy .npy files, a small header giving the
+// shape followed by the raw little endian float32 values, by a background thread
+// so debug runs keep nearly the timing of production runs. Arrays are handed over
+// by move, pass a copy if it is still needed. Files are written in the order queued.
+void dump_npy(const std::string& filename, Array2D<float>&& a);     // shape (nr, nc)
+void dump_npy(const std::string& filename, ArrayRGB&& a);           // shape (nr, nc, 3)
+void wait_for_dumps();                                              // block until queued files are written
+
+// Saves an image as a (nr, nc, 3) .npy a band of rows at a time, for streamed images
+class NpyRowWriter {
+    std::shared_ptr<FILE> file;
+public:
+    NpyRowWriter(const std::string& filename, int nr, int nc);
+    void write(ArrayRGB&& band);    // next rows, queued like dump_npy()
+};
+
+#endif
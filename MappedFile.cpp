@@ -0,0 +1,181 @@
+/*
+Copyright (c) <2020> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include "MappedFile.h"
+
+// All of stdin, read the first time it is needed. TIFF readers need to seek so a pipe can't be read directly
+static const std::vector<uint8_t>& stdin_bytes()
+{
+    static const std::vector<uint8_t> bytes = [] {
+#ifdef _WIN32
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        std::vector<uint8_t> ret;
+        uint8_t buf[1 << 16];
+        for (size_t n; (n = fread(buf, 1, sizeof(buf), stdin)) > 0; )
+            ret.insert(ret.end(), buf, buf + n);
+        return ret;
+    }();
+    return bytes;
+}
+
+MappedFile::MappedFile(const char* filename)
+{
+    if (strcmp(filename, "-") == 0)
+    {
+        const std::vector<uint8_t>& bytes = stdin_bytes();
+        if (!bytes.empty())
+        {
+            base = bytes.data();
+            length = bytes.size();
+            from_stdin = true;
+        }
+        return;
+    }
+#ifdef _WIN32
+    HANDLE f = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (f == INVALID_HANDLE_VALUE)
+        return;
+    LARGE_INTEGER sz;
+    HANDLE m = GetFileSizeEx(f, &sz) && sz.QuadPart > 0 ? CreateFileMappingA(f, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+    void* view = m ? MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0) : nullptr;
+    if (view == nullptr)
+    {
+        if (m) CloseHandle(m);
+        CloseHandle(f);
+        return;
+    }
+    file = f;
+    mapping = m;
+    base = static_cast<const uint8_t*>(view);
+    length = sz.QuadPart;
+#else
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return;
+    struct stat st;
+    void* view = fstat(fd, &st) == 0 && st.st_size > 0 ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);      // mapping stays valid
+    if (view == MAP_FAILED)
+        return;
+    base = static_cast<const uint8_t*>(view);
+    length = st.st_size;
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+    if (base == nullptr || from_stdin)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(base);
+    CloseHandle(mapping);
+    CloseHandle(file);
+#else
+    munmap(const_cast<uint8_t*>(base), length);
+#endif
+}
+
+void MappedFile::advise_sequential() const
+{
+#ifndef _WIN32
+    if (base && !from_stdin)
+        madvise(const_cast<uint8_t*>(base), length, MADV_SEQUENTIAL);
+#endif
+}
+
+void MappedFile::prefetch(uint64_t offset, uint64_t len) const
+{
+    if (base == nullptr || from_stdin || offset >= length)
+        return;
+    len = std::min(len, length - offset);
+#ifdef _WIN32
+    WIN32_MEMORY_RANGE_ENTRY range{ const_cast<uint8_t*>(base + offset), static_cast<SIZE_T>(len) };
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+    uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    uint64_t start = offset / page * page;
+    madvise(const_cast<uint8_t*>(base + start), len + offset - start, MADV_WILLNEED);
+#endif
+}
+
+// libtiff client procs, each handle has its own read position into the shared mapping
+namespace {
+struct MappedTiff {
+    const MappedFile* file;
+    toff_t pos;
+    static tmsize_t read(thandle_t h, void* buf, tmsize_t size)
+    {
+        auto m = static_cast<MappedTiff*>(h);
+        uint64_t avail = m->pos < m->file->size() ? m->file->size() - m->pos : 0;
+        tmsize_t n = static_cast<tmsize_t>(std::min<uint64_t>(size, avail));
+        if (n > 0)
+            memcpy(buf, m->file->data() + m->pos, n);
+        m->pos += n;
+        return n;
+    }
+    static tmsize_t write(thandle_t, void*, tmsize_t) { return 0; }
+    static toff_t seek(thandle_t h, toff_t off, int whence)
+    {
+        auto m = static_cast<MappedTiff*>(h);
+        m->pos = whence == SEEK_SET ? off : whence == SEEK_CUR ? m->pos + off : m->file->size() + off;
+        return m->pos;
+    }
+    static int close(thandle_t h) { delete static_cast<MappedTiff*>(h); return 0; }
+    static toff_t size(thandle_t h) { return static_cast<MappedTiff*>(h)->file->size(); }
+    static int map(thandle_t h, void** base, toff_t* size)
+    {
+        auto m = static_cast<MappedTiff*>(h);
+        *base = const_cast<uint8_t*>(m->file->data());
+        *size = m->file->size();
+        return 1;
+    }
+    static void unmap(thandle_t, void*, toff_t) {}
+};
+}
+
+TIFF* MappedFile::open_tiff(const char* name) const
+{
+    if (base == nullptr)
+        return 0;
+    auto handle = new MappedTiff{ this, 0 };
+    TIFF* tif = TIFFClientOpen(name, "r", handle, MappedTiff::read, MappedTiff::write, MappedTiff::seek,
+        MappedTiff::close, MappedTiff::size, MappedTiff::map, MappedTiff::unmap);
+    if (tif == 0)
+        delete handle;
+    return tif;
+}
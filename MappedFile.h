@@ -0,0 +1,56 @@
+/*
+Copyright (c) <2020> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <tiffio.h>
+
+// Read only memory mapping of a whole file. libtiff reads through the mapping
+// with open_tiff() and uncompressed strips and tiles can be used in place
+// without being copied. The OS pages in only the parts that are touched.
+// The file name "-" is stdin, read into memory once and shared by all MappedFiles.
+class MappedFile {
+public:
+    explicit MappedFile(const char* filename);
+    ~MappedFile();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    bool is_open() const { return base != nullptr; }
+    const uint8_t* data() const { return base; }
+    uint64_t size() const { return length; }
+    void advise_sequential() const;                         // hint that the file is read front to back
+    void prefetch(uint64_t offset, uint64_t len) const;     // hint that a range will be needed soon
+    TIFF* open_tiff(const char* name) const;                // libtiff read handle on the mapping, 0 on failure
+private:
+    const uint8_t* base = nullptr;
+    uint64_t length = 0;
+    bool from_stdin = false;
+#ifdef _WIN32
+    void* file = nullptr;       // HANDLEs
+    void* mapping = nullptr;
+#endif
+};
+
+#endif
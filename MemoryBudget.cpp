@@ -0,0 +1,172 @@
+/*
+Copyright (c) <2020> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <vector>
+#include "MemoryBudget.h"
+#include "Refl_helpers.h"
+
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+namespace {
+
+constexpr std::size_t MB = std::size_t(1) << 20;
+
+std::size_t rgb_bytes(std::size_t nr, std::size_t pitch)
+{
+    return 3 * pool_block_bytes(nr * pitch * sizeof(float));
+}
+
+// Peak image buffer bytes of process_image() for the pages of a tif. Each page is held while
+// the next is decoded. make_correction_field() adds the image with 1" margins, kept at the
+// largest page's size, downsample()'s padded copy of it and the reduced images, which together
+// are under a quarter of it.
+std::size_t in_memory_bytes(const vector<TifInfo>& headers, const string& image_out, const Options& options)
+{
+    std::size_t peak = 0;
+    std::size_t expanded_kept = 0;
+    for (size_t i = 0; i < headers.size(); i++)
+    {
+        ArrayRGB page = TiffFormat(headers[i], 1.0f);
+        std::size_t bytes = rgb_bytes(page.nr, page.nc);
+        if (i + 1 < headers.size())
+            bytes += rgb_bytes(headers[i + 1].height, headers[i + 1].width);
+        if (!options.use_correction_field)
+        {
+            int margins = page.dpi;
+            std::size_t expanded = rgb_bytes(page.nr + 2 * margins + 6, padded_pitch(page.nc + 2 * margins + 6));
+            expanded_kept = std::max(expanded_kept, expanded);
+            bytes += expanded_kept + expanded + expanded / 4;
+        }
+        if (options.save_intermediate_files)        // corrected.npy is written from a copy
+            bytes += rgb_bytes(page.nr, page.nc);
+        if (!headers[i].native())                   // libtiff's RGBA conversion, 4 bytes a pixel
+            bytes += std::size_t(page.nr) * page.nc * 4;
+        if (image_out == "-")                       // stdout's tif is built in memory
+        {
+            int bits = options.force_output_bits != 0 ? options.force_output_bits : page.from_float ? 32 : page.from_16bits ? 16 : 8;
+            bytes += std::size_t(page.nr) * page.nc * 3 * bits / 8;
+        }
+        peak = std::max(peak, bytes);
+    }
+    return peak;
+}
+
+// Single page in memory estimate for -B, 0 if process_image() would stream it or can't read it
+std::size_t batch_bytes(const vector<TifInfo>& pages, const string& image_out, const Options& options)
+{
+    if (options.streaming || options.compact_storage != "" || pages.size() != 1 || pages[0].height == 0 || pages[0].width == 0)
+        return 0;
+    return in_memory_bytes(pages, image_out, options);
+}
+
+}
+
+std::size_t memory_budget(const Options& options)
+{
+    return options.max_memory > 0 ? std::size_t(options.max_memory) * MB : physical_memory();
+}
+
+std::size_t physical_memory()
+{
+#ifdef _WIN32
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    return GlobalMemoryStatusEx(&status) ? std::size_t(status.ullTotalPhys) : 0;
+#else
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGE_SIZE);
+    return pages > 0 && page_size > 0 ? std::size_t(pages) * std::size_t(page_size) : 0;
+#endif
+}
+
+MemoryPlan plan_memory(const vector<TifInfo>& pages, const string& image_out, const Job& job)
+{
+    MemoryPlan plan;
+    plan.compact = job.options.compact_storage != "";
+    plan.stream = job.options.streaming || plan.compact;
+    plan.streamable = pages.size() == 1 && pages[0].native();
+    plan.budget = memory_budget(job.options);
+    if (plan.budget == 0 || pages.empty())
+        return plan;                // left to the readers to report
+    plan.in_memory = in_memory_bytes(pages, image_out, job.options);
+
+    if (job.options.print_line_and_time)
+        job.log << "Estimated peak correcting in memory: " << plan.in_memory / MB << "MB\n";
+    const char* budget_name = job.options.max_memory > 0 ? "the -K budget" : "physical memory";
+    // a quarter is left for freed buffers kept for reuse and, without -K, everything else
+    if (!plan.stream && plan.in_memory > plan.budget - plan.budget / 4)
+    {
+        job.log << "Correcting in memory needs about " << plan.in_memory / MB << "MB, over 3/4 of "
+            << budget_name << " of " << plan.budget / MB << "MB";
+        if (plan.streamable)
+        {
+            job.log << ", streaming\n";
+            plan.stream = true;
+        }
+        else
+        {
+            job.log << "\n";
+            validate(job.options.max_memory == 0, "Tif can't be streamed, -K must be at least " + std::to_string(plan.in_memory * 4 / 3 / MB + 1));
+        }
+    }
+    std::size_t compact_bytes = std::size_t(pages[0].height) * pages[0].width * 3 * sizeof(uint16_t);
+    if (plan.compact && plan.stream && compact_bytes > plan.budget / 2)
+    {
+        job.log << "-Q image of " << compact_bytes / MB << "MB is over half of " << budget_name << ", decoding the tif for each pass instead\n";
+        plan.compact = false;
+    }
+    reset_pool_high_water();
+    return plan;
+}
+
+std::size_t batch_image_bytes(const vector<TifInfo>& pages, const string& image_out, const Options& options)
+{
+    std::size_t in_memory = batch_bytes(pages, image_out, options);
+    std::size_t budget = memory_budget(options);
+    return budget == 0 || in_memory <= budget - budget / 4 ? in_memory : 0;
+}
+
+bool fits_batch_pipeline(const vector<TifInfo>& pages, const string& image_out, const Options& options)
+{
+    std::size_t in_memory = batch_bytes(pages, image_out, options);
+    std::size_t budget = memory_budget(options);
+    return in_memory != 0 && (budget == 0 || in_memory + 2 * rgb_bytes(pages[0].height, pages[0].width) <= budget - budget / 4);
+}
+
+void report_memory(const Job& job, const char* phase)
+{
+    if (!job.options.print_line_and_time)
+        return;
+    PoolMemory m = pool_memory();
+    job.log << "Memory " << phase << ": " << m.high_water / MB << "MB high water, " << m.in_use / MB << "MB in use, "
+        << m.kept / MB << "MB kept for reuse" << endl;
+    reset_pool_high_water();
+}
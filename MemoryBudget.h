@@ -0,0 +1,62 @@
+/*
+Copyright (c) <2020> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef MEMORYBUDGET_H
+#define MEMORYBUDGET_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+struct Options;
+struct Job;
+struct TifInfo;
+
+// How process_image() corrects an image, chosen before anything large is allocated.
+// The peak memory of correcting it in memory is estimated from the tif headers and
+// compared with the -K budget, or physical memory without one. Images that won't fit
+// are streamed if they can be, and -Q's compact copy is dropped if it won't fit either.
+struct MemoryPlan {
+    std::size_t budget = 0;         // bytes, 0 if unknown
+    std::size_t in_memory = 0;      // estimated peak bytes correcting in memory, 0 if unknown
+    bool stream = false;            // stream_image(), a band of rows at a time
+    bool streamable = false;        // single page tif TiffRowReader can decode a band at a time
+    bool compact = false;           // keep -Q's compact copy while streaming
+};
+
+MemoryPlan plan_memory(const std::vector<TifInfo>& pages, const std::string& image_out, const Job& job);   // pages from TiffPages()
+std::size_t memory_budget(const Options& options);     // -K or physical memory, bytes, 0 if unknown
+std::size_t physical_memory();      // bytes, 0 if unknown
+
+// Estimated peak bytes of correcting a tif in memory for -B, as plan_memory() without printing
+// anything. 0 if it would be streamed, is multi-page or can't be read, so process_image() takes it alone.
+std::size_t batch_image_bytes(const std::vector<TifInfo>& pages, const std::string& image_out, const Options& options);
+
+// Whether -B can correct a tif in memory with the next file's image being read and the
+// previous one's being written, as plan_memory() would without printing anything. False if
+// it would be streamed, is multi-page or can't be read, so process_image() takes it alone.
+bool fits_batch_pipeline(const std::vector<TifInfo>& pages, const std::string& image_out, const Options& options);
+
+// -T, image buffer memory held since the last report or the start of the image
+void report_memory(const Job& job, const char* phase);
+
+#endif
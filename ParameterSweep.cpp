@@ -0,0 +1,278 @@
+/*
+Copyright (c) <2020> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _CRT_SECURE_NO_WARNINGS
+
+// Parameter sweep over -N, -S and -C values for tuning.
+// The tif file is decoded once. The reduced image and its convolution with the
+// reflection matrix are shared by all -N values. Both the downsample and the
+// convolution are linear so changing -S only adds (S - S0) times the
+// convolution of the 1" surround alone, which is computed once per
+// calibration file and only where the reflection matrix overlaps the surround.
+
+#include "Refl_helpers.h"
+#include "ProcessCache.h"
+
+using std::string;
+using std::vector;
+using std::array;
+using std::cout;
+using std::endl;
+
+struct SweepSpec {
+    vector<float> gain_restore;     // -N values
+    vector<float> edge_refl;        // -S values
+    vector<string> calibration;     // -C files
+};
+
+// Parse "N=0,50,100;S=.5,.85;C=cal_a.txt,cal_b.txt", any may be omitted
+static SweepSpec parse_sweep(const string& spec)
+{
+    auto split = [](const string& s, char delim) {
+        vector<string> ret;
+        size_t start = 0;
+        for (size_t end; (end = s.find(delim, start)) != string::npos; start = end + 1)
+            ret.push_back(s.substr(start, end - start));
+        ret.push_back(s.substr(start));
+        return ret;
+    };
+    SweepSpec ret;
+    for (const string& group : split(spec, ';'))
+    {
+        if (group.empty())
+            continue;
+        validate(group.size() > 2 && group[1] == '=', "-X sweep must look like \"N=0,50;S=.5,.85;C=cal.txt\"");
+        for (const string& value : split(group.substr(2), ','))
+        {
+            if (group[0] == 'N')
+                ret.gain_restore.push_back(std::stof(value));
+            else if (group[0] == 'S')
+                ret.edge_refl.push_back(std::stof(value));
+            else if (group[0] == 'C')
+                ret.calibration.push_back(value);
+            else
+                validate(false, "-X sweep parameters are N, S, or C");
+        }
+    }
+    return ret;
+}
+
+// One dimensional version of downsample(ArrayRGB) including its edge duplication.
+// The 5x5 gaussian is the outer product of {g2, g1, g0, g1, g2}
+static vector<float> downsample(const vector<float>& from, int rate)
+{
+    const float g0 = std::sqrt(0.117928f);
+    const array<float, 5> smooth{ 0.029406f / g0, 0.083334f / g0, g0, 0.083334f / g0, 0.029406f / g0 };
+    int n = static_cast<int>(from.size());
+    int resid = (n - 1) % rate;
+    int xtra = resid == 0 ? 0 : rate - resid;
+    vector<float> fromEx(n + 4 + xtra);
+    std::copy(from.begin(), from.end(), fromEx.begin() + 2);
+    for (int i = 0; i < xtra; i++)
+        fromEx[n + 2 + i] = fromEx[n + 1 + i];
+    fromEx[1] = fromEx[2];
+    fromEx[0] = fromEx[1];
+    fromEx[fromEx.size() - 2] = fromEx[fromEx.size() - 3];
+    fromEx[fromEx.size() - 1] = fromEx[fromEx.size() - 3];
+    vector<float> ret((fromEx.size() - (rate == 2 ? 3 : 2)) / rate);
+    for (size_t x = 0; x < ret.size(); x++)
+        for (int i = 0; i < 5; i++)
+            ret[x] += smooth[i] * fromEx[rate * x + i];
+    return ret;
+}
+
+// Reduced image of a surround of 1 around an image of 0, same size as reduce_with_margins().
+// Zero inside [top, bottom) x [left, right)
+struct MarginMask {
+    Array2D<float> mask;
+    int top, bottom, left, right;
+};
+
+static MarginMask reduced_margin_mask(int nr, int nc, int dpi, int x2, int x3)
+{
+    // reduce the row and column indicators of the image area separately, then combine
+    auto reduce = [dpi, x2, x3](int len) {
+        vector<float> v(len + 2 * dpi, 0.0f);
+        std::fill(v.begin() + dpi, v.begin() + dpi + len, 1.0f);
+        for (int i = 0; i < x3; i++)
+            v = downsample(v, 3);
+        for (int i = 0; i < x2; i++)
+            v = downsample(v, 2);
+        return v;
+    };
+    auto inside = [](const vector<float>& v, int& first, int& last) {
+        const float eps = 1e-6f;
+        first = static_cast<int>(std::find_if(v.begin(), v.end(), [eps](float x) { return x >= 1 - eps; }) - v.begin());
+        last = first;
+        while (last < int(v.size()) && v[last] >= 1 - eps)
+            last++;
+    };
+    vector<float> rows = reduce(nr);
+    vector<float> cols = reduce(nc);
+    MarginMask ret;
+    inside(rows, ret.top, ret.bottom);
+    inside(cols, ret.left, ret.right);
+    ret.mask = Array2D<float>(int(rows.size()), int(cols.size()));
+    for (int i = 0; i < ret.mask.nr; i++)
+        for (int ii = 0; ii < ret.mask.nc; ii++)
+        {
+            bool in = i >= ret.top && i < ret.bottom && ii >= ret.left && ii < ret.right;
+            ret.mask(i, ii) = in ? 0.0f : 1.0f - rows[i] * cols[ii];
+        }
+    return ret;
+}
+
+// convolve_reflected_light() of the surround mask, skipping positions where the
+// reflection matrix lies entirely inside the image and the result is 0
+static Array2D<float> convolve_margin(const MarginMask& m, const ArrayRGB& refl_area)
+{
+    Array2D<float> ret(m.mask.nr - refl_area.nr + 1, m.mask.nc - refl_area.nc + 1, 0.0f);
+    auto fix = [&m, &refl_area, &ret](int s_row, int e_row) {
+        for (int i = s_row; i < e_row; i++)
+        {
+            bool rows_inside = i >= m.top && i + refl_area.nr <= m.bottom;
+            for (int ii = 0; ii < ret.nc; ii++)
+            {
+                if (rows_inside && ii >= m.left && ii + refl_area.nc <= m.right)
+                    continue;
+                float sum = 0;
+                for (int j = 0; j < refl_area.nr; j++)
+                    for (int jj = 0; jj < refl_area.nc; jj++)
+                        sum += m.mask(i + j, ii + jj) * refl_area(j, jj, 0);
+                ret(i, ii) = sum;
+            }
+        }
+    };
+    auto c0 = std::async(launchType, fix, 0, ret.nr / 3);
+    auto c1 = std::async(launchType, fix, ret.nr / 3, 2 * ret.nr / 3);
+    auto c2 = std::async(launchType, fix, 2 * ret.nr / 3, ret.nr);
+    c0.get(); c1.get(); c2.get();
+    return ret;
+}
+
+// Correct one image for every combination of -X sweep values, saving
+// outfile_C<n>_S<edge>_N<gain>.tif for each and printing summary statistics.
+// The job's -N and -S are set for each combination
+void sweep_image(const string& image_in_raw, const string& image_out, Job& job)
+{
+    validate(file_is_tif(image_in_raw) && file_is_tif(image_out), "Only Tif files allowed");
+    SweepSpec spec = parse_sweep(job.options.sweep);
+    if (spec.gain_restore.empty())
+        spec.gain_restore.push_back(job.options.gain_restore_scale);
+    if (spec.edge_refl.empty())
+        spec.edge_refl.push_back(job.options.edge_reflectance);
+    if (spec.calibration.empty())
+        spec.calibration.push_back(job.options.calibration_file);
+    job.log << "\nSweeping " << spec.calibration.size() * spec.edge_refl.size() * spec.gain_restore.size()
+        << " settings, input: " << image_in_raw << "\n";
+
+    vector<TifInfo> pages = TiffPages(image_in_raw.c_str());
+    validate(!pages.empty(), "Could not read " + image_in_raw);
+    ArrayRGB raw = TiffRead(image_in_raw.c_str(), 1.0f, pages[0]);    // decoded once, gamma applied per calibration
+    validate(raw.nc > 0, "Could not read " + image_in_raw);
+    if (pages[0].read_as_8_bits())
+        job.log << "16 bit tif file not recognized, reverting to 8 bit read.\n";
+    ArrayRGB image_in;
+    ArrayRGB image_reduced;
+    float image_gamma = 0;
+    struct Result { int cal; float edge, gain; array<float, 3> ave{}; float white = 0; };
+    vector<Result> results;
+    auto base_name = file_parts(image_out).first;
+    if (job.options.print_line_and_time) job.log << __LINE__ << "  " << job.timer.stop() << endl;
+
+    for (int cal = 0; cal < int(spec.calibration.size()); cal++)
+    {
+        auto calibration = cached_calibration(spec.calibration[cal], true);
+        const InterpolateRefl& interpolate = *calibration;
+        float gamma = job.options.correct_image_in_aRGB ? 2.2f : static_cast<float>(interpolate.gamma);
+        auto kernel = cached_kernel(interpolate, raw.dpi);
+        const ArrayRGB& refl_area = kernel->refl_area;
+        int x2 = kernel->x2;
+        int x3 = kernel->x3;
+
+        // Gamma and reduced image only change if the calibration's gamma does
+        if (gamma != image_gamma)
+        {
+            image_in = raw;
+            image_in.gamma = gamma;
+            if (!raw.from_float)    // float tifs are already linear
+                for (auto& plane : image_in.v)
+                    for (auto& x : plane)
+                        x = pow(x, gamma);
+            image_reduced = reduce_with_margins(image_in, spec.edge_refl[0], x2, x3);
+            image_gamma = gamma;
+        }
+        ArrayRGB base = convolve_reflected_light(image_reduced, refl_area);
+        Array2D<float> margin;
+        if (spec.edge_refl.size() > 1)
+            margin = convolve_margin(reduced_margin_mask(image_in.nr, image_in.nc, image_in.dpi, x2, x3), refl_area);
+        if (job.options.print_line_and_time) job.log << __LINE__ << "  " << job.timer.stop() << endl;
+
+        for (float edge : spec.edge_refl)
+        {
+            CorrectionField correction;
+            correction.image_nr = image_in.nr;
+            correction.image_nc = image_in.nc;
+            correction.image_dpi = image_in.dpi;
+            correction.reduction = image_in.dpi / refl_area.dpi;
+            correction.gamma = gamma;
+            correction.edge_reflectance = edge;
+            correction.calibration_hash = interpolate.file_hash;
+            correction.field = base;
+            float delta = edge - spec.edge_refl[0];
+            for (auto& plane : correction.field.v)
+                for (size_t i = 0; i < plane.size(); i++)
+                {
+                    float sum = plane[i] + (delta != 0 ? delta * margin.v[i] : 0.0f);
+                    plane[i] = exp(sum) - 1;    // second order effect (reflections of reflections) included
+                }
+
+            for (float gain : spec.gain_restore)
+            {
+                ArrayRGB image = image_in;
+                job.options.gain_restore_scale = std::clamp(gain, 0.0f, 100.0f);
+                job.options.edge_reflectance = edge;
+                apply_correction_field(image, correction, interpolate.gain_adj, job.options);
+
+                char suffix[64];
+                snprintf(suffix, sizeof(suffix), "_C%d_S%.3g_N%.3g.tif", cal + 1, edge, gain);
+                job.log << "Writing " << base_name + suffix << "\n";
+                write_corrected_image(image, base_name + suffix, job);
+
+                Result r{ cal + 1, edge, gain };
+                for (int color = 0; color < 3; color++)
+                    r.ave[color] = 255 * pow(get_collection_stats(image.v[color]).ave(), 1 / gamma);
+                r.white = 255 * pow(detected_white(image), 1 / gamma);
+                results.push_back(r);
+            }
+        }
+    }
+
+    char line[128];
+    job.log << "\n  Cal      -S      -N    Ave R    Ave G    Ave B   99.99%\n";
+    for (const auto& r : results)
+    {
+        snprintf(line, sizeof(line), "%5d %7.3f %7.1f %8.2f %8.2f %8.2f %8.2f\n", r.cal, r.edge, r.gain, r.ave[0], r.ave[1], r.ave[2], r.white);
+        job.log << line;
+    }
+    for (int cal = 0; cal < int(spec.calibration.size()); cal++)
+        job.log << "Cal " << cal + 1 << ": " << spec.calibration[cal] << "\n";
+}
@@ -29,19 +29,17 @@ using std::string;
 using std::pair;
 using std::array;
 
-// Read RGB from tif file into a 2D Array
-Array2D<V3> FromTiffReader(string arg)
+V3 ChartAlignment::operator()(const ArrayRGB& rgb, int row, int col) const
 {
-    ArrayRGB rgb = TiffRead(arg.c_str(), 1.0);
-    Array2D<V3> rgbout(rgb.nr, rgb.nc);
-    for (int i = 0; i < rgb.nr; i++)
-        for (int ii = 0; ii < rgb.nc; ii++)
-        {
-            rgbout(i, ii)[0] = rgb(i, ii, 0);
-            rgbout(i, ii)[1] = rgb(i, ii, 1);
-            rgbout(i, ii)[2] = rgb(i, ii, 2);
-        }
-    return rgbout;
+    if (aligned)
+    {
+        if (row < int(vs.first) || row >= int(vs.second) || col < int(hs.first) || col >= int(hs.second))
+            return V3{ 1.0f, 1.0f, 1.0f };
+        int r = row + row_skew[col - hs.first];
+        col += col_skew[row - vs.first];
+        row = r;
+    }
+    return V3{ rgb(row, col, 0), rgb(row, col, 1), rgb(row, col, 2) };
 }
 
 /// <summary>
@@ -49,13 +47,13 @@ Array2D<V3> FromTiffReader(string arg)
 /// </summary>
 /// <param name="rgbin"></param>
 /// <returns></returns>
-Array2D<float> get_min_rgb(const Array2D<V3>& rgbin)
+Array2D<float> get_min_rgb(const ArrayRGB& rgbin)
 {
     Array2D<float> rgbout(rgbin.nr, rgbin.nc);
     for (int i = 0; i < rgbin.nr; i++)
         for (int ii = 0; ii < rgbin.nc; ii++)
         {
-            rgbout(i, ii) = static_cast<float>(std::min({ rgbin(i,ii)[0], rgbin(i,ii)[1], rgbin(i,ii)[2] }));
+            rgbout(i, ii) = static_cast<float>(std::min({ rgbin(i,ii,0), rgbin(i,ii,1), rgbin(i,ii,2) }));
         }
 
     return rgbout;
@@ -89,20 +87,37 @@ int get_boundary(const vector<AveStd>& v, float min, float max)
 /// </summary>
 /// <param name="v"></param>
 /// <returns></returns>
-pair<int,int> strips_info(const Array2D<float>& v) {
-    auto minmax = std::minmax_element(v.v.begin(), v.v.end());
+// A transposed view is walked in memory order, down its columns, accumulating
+// every row's statistics at once so it needn't be copied into a transposed array.
+pair<int,int> strips_info(Array2DView<const float> v) {
+    bool by_columns = v.col_stride != 1;
+    float vmin = v(0, 0), vmax = v(0, 0);
+    vector<Statistics> stats(v.nr);
+    if (by_columns)
+        for (int ii = 0; ii < v.nc; ii++)
+            for (int i = 0; i < v.nr; i++)
+            {
+                vmin = std::min(vmin, v(i, ii));
+                vmax = std::max(vmax, v(i, ii));
+                stats[i].clk(v(i, ii));
+            }
+    else
+        for (int i = 0; i < v.nr; i++)
+            for (int ii = 0; ii < v.nc; ii++)
+            {
+                vmin = std::min(vmin, v(i, ii));
+                vmax = std::max(vmax, v(i, ii));
+                stats[i].clk(v(i, ii));
+            }
     vector<AveStd> strips(v.nr);
     for (int i = 0; i < v.nr; i++)
     {
-        Statistics strip;
-        for (int ii = 0; ii < v.nc; ii++)     // copy a row
-            strip.clk(v(i, ii));
-        strips[i].ave = strip.ave();
-        strips[i].std = strip.std();
+        strips[i].ave = stats[i].ave();
+        strips[i].std = stats[i].std();
     }
-    int top = get_boundary(strips, *minmax.first, *minmax.second);
+    int top = get_boundary(strips, vmin, vmax);
     std::reverse(strips.begin(), strips.end());
-    int bottom = int(strips.size()) - get_boundary(strips, *minmax.first, *minmax.second);
+    int bottom = int(strips.size()) - get_boundary(strips, vmin, vmax);
     return std::pair<int, int>(top, bottom);
 };
 
@@ -113,9 +128,9 @@ pair<int,int> strips_info(const Array2D<float>& v) {
 /// <param name="g_in"></param>
 /// <param name="flip"></param> if true, rotate image 90 degrees clockwise
 /// <returns></returns>
-pair<size_t, size_t> get_patch_ends(const Array2D<float>& g_in, bool flip)
+pair<size_t, size_t> get_patch_ends(Array2DView<const float> g_in, bool flip)
 {
-    auto g = flip ? transpose(g_in) : g_in;
+    auto g = flip ? transpose_view(g_in) : g_in;
     //TiffWrite("test\\test_image.tif", g);
     return strips_info(g);
 }
@@ -197,21 +212,6 @@ PatchStats process_sample(const vector<BlockVal>& sample)
     return ret;
 }
 
-// get statistics over the entire set of patches column by column
-vector<vector<PatchStats>> process_samples(const vector<vector<vector<BlockVal>>>& samples)
-{
-    vector<vector<PatchStats>> ret;
-    for (auto& x : samples) {
-        vector<PatchStats> columns;
-        for (auto& xx : x)
-        {
-            columns.push_back(process_sample(xx));
-        }
-        ret.push_back(columns);
-    }
-    return ret;
-}
-
 // return metrics for patches sizes from arg:start to maxRowsAndCols
 // smallest metric indicates number of patches in row or column
 vector<double> find_patch_metric(vector<double>& v, int start)
@@ -241,7 +241,7 @@ vector<double> find_patch_metric(vector<double>& v, int start)
 }
 
 // get row and col counts using minimums from find_patch_metric
-VectorLocs get_rows_and_columns(const Array2D<V3>& rgb, VectorLocs hs, VectorLocs vs)
+VectorLocs get_rows_and_columns(const ArrayRGB& rgb, const ChartAlignment& align, VectorLocs hs, VectorLocs vs)
 {
     VectorLocs ret;
     vector<double> cols(maxRowsAndCols+1);
@@ -250,14 +250,14 @@ VectorLocs get_rows_and_columns(const Array2D<V3>& rgb, VectorLocs hs, VectorLoc
     {
         vector<double> green_slice_h;
         for (size_t i = hs.first; i < hs.second; i++)
-            green_slice_h.push_back(rgb[int(vs.first + pass*(vs.second-vs.first))] [i] [1]);
+            green_slice_h.push_back(align(rgb, int(vs.first + pass*(vs.second-vs.first)), int(i))[1]);
         vector<double> cols_1 = find_patch_metric(green_slice_h, minRowsAndCols);
         for (size_t i = 0; i < cols_1.size(); i++)
             cols[i] += cols_1[i];
 
         vector<double> green_slice_v;
         for (size_t i = vs.first; i < vs.second; i++)
-            green_slice_v.push_back(rgb[int(i)][int(hs.first + pass*(hs.second-hs.first))][1]);
+            green_slice_v.push_back(align(rgb, int(i), int(hs.first + pass*(hs.second-hs.first)))[1]);
         vector<double> rows_1 = find_patch_metric(green_slice_v, minRowsAndCols);
         for (int i = 0; i < rows_1.size(); i++)
             rows[i] += rows_1[i];
@@ -269,12 +269,13 @@ VectorLocs get_rows_and_columns(const Array2D<V3>& rgb, VectorLocs hs, VectorLoc
 
 
 
-Array2D<V3> refine_image(const Array2D<V3> &rgbin, const Array2D<float> rgbmin, const VectorLocs vs, const VectorLocs hs)
+// Find the skew that aligns the patch grid so its top is parallel, no pixels are copied
+ChartAlignment refine_image(const Array2D<float>& rgbmin, const VectorLocs vs, const VectorLocs hs)
 {
-    auto rgb = rgbin;
+    ChartAlignment ret;
     // if not enough white space to align assume proper registration
     if (vs.first < 10 || hs.first < 10 || rgbmin.nr-vs.second < 10 || rgbmin.nc - hs.second < 10)
-        return rgb;
+        return ret;
     auto spread = int(std::max(vs.second - vs.first, hs.second - hs.first)+1);
     vector<vector<int>> skew(19, vector<int>(spread));
     for (int angle_i = -9; angle_i <= 9; angle_i++)
@@ -299,57 +300,58 @@ Array2D<V3> refine_image(const Array2D<V3> &rgbin, const Array2D<float> rgbmin,
     for (int i = 0; i < 19; i++)
         errsum[i] = std::accumulate(s[i].begin(), s[i].begin() + 9, 0.0f);
     auto angle_fit = std::min_element(errsum.begin(), errsum.end()) - errsum.begin();
-    std::fill(rgb.v.begin(), rgb.v.end(), V3{ 1.0f,1.0f, 1.0f });
 
-    for (int row=int(vs.first); row < int(vs.second); row++)
-        for (int col = int(hs.first); col < int(hs.second); col++)
-        {
-            rgb(row, col) = rgbin(row+skew[angle_fit][col-hs.first+first_v],
-                                  col+skew[18-angle_fit][row-vs.first+first_h]);
-        }
-    //TiffWrite("test\\testx.tif", rgb,"");
-    return rgb;
+    ret.aligned = true;
+    ret.vs = vs;
+    ret.hs = hs;
+    for (size_t col = hs.first; col < hs.second; col++)
+        ret.row_skew.push_back(skew[angle_fit][col - hs.first + first_v]);
+    for (size_t row = vs.first; row < vs.second; row++)
+        ret.col_skew.push_back(skew[18 - angle_fit][row - vs.first + first_h]);
+    return ret;
 }
 
 // calculate row and col counts then extract data into a 2D grid of patch info
-vector<vector<PatchStats>> extract_patch_data(const Array2D<V3>& rgbin)
+// Each patch's pixels are gathered and reduced to its statistics before the next
+vector<vector<PatchStats>> extract_patch_data(const ArrayRGB& rgbin)
 {
     Array2D<float> rgbmin = get_min_rgb(rgbin);
     auto vs = get_patch_ends(rgbmin,false);     // locate top,bottom of patch grid
     validate(vs.first > 0 && vs.second > 0, "No White Space at Top or Bottom detected.");
-    auto rgbmin1 = rgbmin.clip(Array2D<float>::Extants{ int(vs.first), int(vs.second), 0, int(rgbmin.nc-1) });
+    auto rgbmin1 = rgbmin.clip_view(Array2D<float>::Extants{ int(vs.first), int(vs.second), 0, int(rgbmin.nc-1) });
     auto hs = get_patch_ends(rgbmin1,true);      // locate left,right of patch grid
     validate(hs.first > 0 && hs.second > 0, "No White Space at Left or Right detected.");
-    const auto rgb = refine_image(rgbin, rgbmin, vs, hs);   // align image so top is parallel
-    auto [rows, cols] = get_rows_and_columns(rgb, hs, vs);
+    const ChartAlignment align = refine_image(rgbmin, vs, hs);   // align image so top is parallel
+    rgbmin = Array2D<float>();
+    auto [rows, cols] = get_rows_and_columns(rgbin, align, hs, vs);
     float hdelta = static_cast<float>(hs.second - hs.first + 1) / cols;
     float vdelta = static_cast<float>(vs.second - vs.first + 1) / rows;
-    vector<vector<vector<BlockVal>>> samples;
+    vector<vector<PatchStats>> ret(rows);
+    vector<BlockVal> patch;
     for (size_t row = 0; row < rows; row++)
     {
-        vector<vector<BlockVal>> row_samples;
         for (size_t col = 0; col < cols; col++)
         {
             size_t pos_00 = static_cast<size_t>(round(hs.first + hdelta * col));
             size_t pos_01 = static_cast<size_t>(round(hs.first + hdelta * (col + 1) - 1));
             size_t pos_10 = static_cast<size_t>(round(vs.first + vdelta * row));
             size_t pos_11 = static_cast<size_t>(round(vs.first + vdelta * (row + 1) - 1));
-            vector<BlockVal> patch; patch.reserve((pos_01-pos_00 + 1)*(pos_11 - pos_10 + 1));
+            patch.clear();
+            patch.reserve((pos_01-pos_00 + 1)*(pos_11 - pos_10 + 1));
             //std::cout << pos_00 << " " << pos_01 << " " << pos_10 << " " << pos_11 << "\n";
             for (size_t i = pos_00; i < pos_01; i++)        // horizontal, second coord
                 for (size_t ii = pos_10; ii < pos_11; ii++) // vertical, first coord
                 {
                     BlockVal spot;
-                    spot.pixel = rgb(static_cast<int>(ii), static_cast<int>(i));
+                    spot.pixel = align(rgbin, static_cast<int>(ii), static_cast<int>(i));
                     spot.dist = static_cast<int>(std::min({ i - pos_00, ii - pos_10, pos_01 - i - 1, pos_11 - ii - 1 }));
                     patch.push_back(spot);
                 }
             std::sort(patch.begin(), patch.end(), [](BlockVal& a, BlockVal& b) {return a.dist > b.dist; });
-            row_samples.push_back(patch);
+            ret[row].push_back(process_sample(patch));
         }
-        samples.push_back(row_samples);
     }
-    return process_samples(samples);
+    return ret;
 }
 
 // Extract and add tif image data into charts
@@ -359,35 +361,14 @@ bool PatchCharts::init(string tiff_filename, bool landscape)
     PatchChart chart;
     try
     {
-        {
-            ArrayRGB rgb = TiffRead(tiff_filename.c_str(), 1.0);
-            if (landscape)      // transpose if landscape, Image top must be on left side
-            {
-                ArrayRGB rgb1 = rgb;
-                std::swap(rgb1.nc, rgb1.nr);
-                for (int color = 0; color < 3; color++)
-                    for (int i = 0; i < rgb.nr; i++)
-                        for (int ii = 0; ii < rgb.nc; ii++)
-                            rgb1(ii, rgb.nr-i-1, color) = rgb(i, ii, color);  // Image top must be on left side!
-                chart.tiff_rgb =  rgb1;
-            }
-            else
-                chart.tiff_rgb = rgb;
-        }
-        //TiffWrite("x.tif", tmp.tiff_rgb,"");
-        validate(chart.tiff_rgb.nc > 0, "Invalid image patch file");
-        if (chart.tiff_rgb.dpi !=200)
-            chart.tiff_rgb = arrayRGBChangeDPI(chart.tiff_rgb, 200);
-
-        chart.rgb = Array2D<V3>(chart.tiff_rgb.nr, chart.tiff_rgb.nc);
-        for (int i = 0; i < chart.tiff_rgb.nr; i++)
-            for (int ii = 0; ii < chart.tiff_rgb.nc; ii++)
-            {
-                chart.rgb(i, ii)[0] = chart.tiff_rgb(i, ii, 0);
-                chart.rgb(i, ii)[1] = chart.tiff_rgb(i, ii, 1);
-                chart.rgb(i, ii)[2] = chart.tiff_rgb(i, ii, 2);
-            }
-        chart.patch_data = extract_patch_data(chart.rgb);
+        // the image only lives until its patch statistics are extracted
+        ArrayRGB rgb = TiffRead(tiff_filename.c_str(), 1.0);
+        if (landscape)      // Image top must be on left side!
+            rgb = rotate(rgb, 90);
+        validate(rgb.nc > 0, "Invalid image patch file");
+        if (rgb.dpi !=200)
+            rgb = arrayRGBChangeDPI(rgb, 200);
+        chart.patch_data = extract_patch_data(rgb);
         chart.rows = static_cast<int>(chart.patch_data.size());
         chart.cols = static_cast<int>(chart.patch_data[0].size());
         for (size_t i = 0; i < chart.cols; i++)
@@ -401,7 +382,7 @@ bool PatchCharts::init(string tiff_filename, bool landscape)
         catch (const char* e) {
             err_info = e;
     }
-    charts.push_back(chart);
+    charts.push_back(std::move(chart));
     return true;
 }
 
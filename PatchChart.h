@@ -56,13 +56,24 @@ constexpr int minRowsAndCols=8;
 
 typedef std::pair<size_t, size_t> VectorLocs;
 
-Array2D<V3> FromTiffReader(std::string arg);
-Array2D<float> get_min_rgb(const Array2D<V3>& rgbin);
+/// <summary>
+/// Skew correction of a chart image, maps aligned coordinates to image pixels
+/// so the image is read in place instead of copied. Outside the patch grid
+/// an aligned chart is white.
+/// </summary>
+struct ChartAlignment {
+    bool aligned = false;           // false if the image is used as is
+    VectorLocs vs{}, hs{};          // top, bottom and left, right of patch grid
+    std::vector<int> row_skew;      // row offset for each column of the grid
+    std::vector<int> col_skew;      // column offset for each row of the grid
+    V3 operator()(const ArrayRGB& rgb, int row, int col) const;
+};
+
+Array2D<float> get_min_rgb(const ArrayRGB& rgbin);
 PatchStats process_sample(const std::vector<BlockVal>& sample);
-std::vector<std::vector<PatchStats>> process_samples(const std::vector<std::vector<std::vector<BlockVal>>>& samples);
 std::vector<double> find_patch_metric(std::vector<double>& v, int start);
-VectorLocs get_rows_and_columns(const Array2D<V3>& rgb, VectorLocs hs, VectorLocs vs);
-std::vector<std::vector<PatchStats>> extract_patch_data(const Array2D<V3>& rgb);
+VectorLocs get_rows_and_columns(const ArrayRGB& rgb, const ChartAlignment& align, VectorLocs hs, VectorLocs vs);
+std::vector<std::vector<PatchStats>> extract_patch_data(const ArrayRGB& rgb);
 
 inline V3 operator+(const V3& x, const V3& y) { return V3{ x[0] + y[0], x[1] + y[1], x[2] + y[2] }; }
 inline V3 operator-(const V3& x, const V3& y) { return V3{ x[0] - y[0], x[1] - y[1], x[2] - y[2] }; }
@@ -92,10 +103,8 @@ struct RGB_Stat {
 class PatchCharts   // collection of tif charts
 {
 public:
-    class PatchChart {  // data for each tif image of patches
+    class PatchChart {  // data for each tif image of patches, pixels aren't kept after extraction
     public:
-        ArrayRGB tiff_rgb{};
-        Array2D<V3> rgb{ 0, 0 };
         std::vector<std::vector<PatchStats>> patch_data;
         std::vector<V3> rgb255{};
         int rows{};
@@ -0,0 +1,133 @@
+/*
+Copyright (c) <2020> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include "ProcessCache.h"
+
+using std::string;
+using std::shared_ptr;
+
+namespace {
+
+using Stamp = std::filesystem::file_time_type::rep;
+
+// Modification time of file, 0 if it doesn't exist
+Stamp file_stamp(const string& file)
+{
+    std::error_code ec;
+    auto t = std::filesystem::last_write_time(file, ec);
+    return ec ? 0 : t.time_since_epoch().count();
+}
+
+template <class T>
+struct FileEntry {
+    Stamp stamp;
+    shared_ptr<const T> value;
+};
+
+struct Cache {
+    std::mutex m;
+    std::map<string, FileEntry<InterpolateRefl>> calibrations;
+    std::map<std::pair<uint64_t, int>, shared_ptr<const ReflKernel>> kernels;
+    std::map<string, FileEntry<std::vector<char>>> files;
+    CacheCounters counters;
+};
+
+Cache& cache()
+{
+    static Cache c;
+    return c;
+}
+
+// Entry for file from entries, made by read() if it is missing or the file has changed since
+template <class T, class F>
+shared_ptr<const T> lookup(std::map<string, FileEntry<T>>& entries, CacheCounters& counters, const string& file, F read)
+{
+    counters.lookups++;
+    Stamp stamp = file_stamp(file);
+    auto it = entries.find(file);
+    if (it != entries.end() && it->second.stamp == stamp)
+    {
+        counters.hits++;
+        return it->second.value;
+    }
+    shared_ptr<const T> value = read();
+    entries[file] = { stamp, value };
+    return value;
+}
+
+}
+
+shared_ptr<const InterpolateRefl> cached_calibration(const string& file, bool print)
+{
+    Cache& c = cache();
+    std::lock_guard<std::mutex> lock(c.m);
+    return lookup(c.calibrations, c.counters, file, [&file, print]() {
+        auto ret = std::make_shared<InterpolateRefl>();
+        ret->read_init_file(file, print);
+        return ret;
+    });
+}
+
+shared_ptr<const ReflKernel> cached_kernel(const InterpolateRefl& calibration, int dpi)
+{
+    Cache& c = cache();
+    std::lock_guard<std::mutex> lock(c.m);
+    c.counters.lookups++;
+    auto key = std::make_pair(calibration.file_hash, dpi);
+    auto it = c.kernels.find(key);
+    if (it != c.kernels.end())
+    {
+        c.counters.hits++;
+        return it->second;
+    }
+    auto kernel = std::make_shared<ReflKernel>();
+    std::tie(kernel->refl_area, kernel->x2, kernel->x3) = getReflArea(dpi, calibration);
+    c.kernels[key] = kernel;
+    return kernel;
+}
+
+shared_ptr<const std::vector<char>> cached_file_bytes(const string& file)
+{
+    Cache& c = cache();
+    std::lock_guard<std::mutex> lock(c.m);
+    return lookup(c.files, c.counters, file, [&file]() {
+        std::ifstream in(file, std::ios::binary);
+        if (in.fail())
+            throw "File could not be opened";
+        auto ret = std::make_shared<std::vector<char>>();
+        in.seekg(0, std::ios_base::end);
+        ret->resize(size_t(in.tellg()));
+        in.seekg(0, std::ios_base::beg);
+        in.read(ret->data(), ret->size());
+        return ret;
+    });
+}
+
+CacheCounters cache_counters()
+{
+    Cache& c = cache();
+    std::lock_guard<std::mutex> lock(c.m);
+    return c.counters;
+}
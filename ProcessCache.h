@@ -0,0 +1,52 @@
+/*
+Copyright (c) <2020> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef PROCESSCACHE_H
+#define PROCESSCACHE_H
+
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "interpolate.h"
+#include "tiffresults.h"
+
+// Process wide cache of what every image of a batch shares: the parsed -C calibration, its
+// reflection kernel at each image dpi, and the -P profile's bytes. Files are keyed by path and
+// modification time so one edited between images is read again, kernels by the calibration's
+// hash and dpi. Entries are immutable and shared, lookups are thread safe.
+struct ReflKernel {
+    ArrayRGB refl_area;     // as getReflArea()
+    int x2 = 0, x3 = 0;     // number of 2x and 3x downsizes from image to refl_area dpi
+};
+
+std::shared_ptr<const InterpolateRefl> cached_calibration(const std::string& file, bool print = false);  // print if read
+std::shared_ptr<const ReflKernel> cached_kernel(const InterpolateRefl& calibration, int dpi);
+std::shared_ptr<const std::vector<char>> cached_file_bytes(const std::string& file);
+
+struct CacheCounters {
+    uint64_t lookups = 0;
+    uint64_t hits = 0;
+};
+CacheCounters cache_counters();
+
+#endif
@@ -21,7 +21,14 @@ SOFTWARE.
 */
 
 #include "Refl_helpers.h"
+#include "DebugDump.h"
+#include "CompactImage.h"
+#include "MemoryBudget.h"
+#include "ProcessCache.h"
 #include "algorithm"
+#include <deque>
+#include <sstream>
+#include <thread>
 
 using std::string;
 using std::vector;
@@ -39,19 +46,32 @@ void process_args(vector<string>& args, Options& options)
     procFlag("-b", args, options.batch_file);               // Batch file mode, read commands from file
     procFlag("-C", args, options.calibration_file);         // Default Scanner reflection calibration text file
     procFlag("-c", args, options.scanner_cal);              // Scanner reflection calibration tif file
-    procFlag("-F", args, options.force_output_bits);        // Force 16 bit output file. 8 bit input files default to 8 bit output files
+    procFlag("-E", args, options.export_correction_field);  // save re-reflected light estimate as infile.rcf for later -U runs
+    procFlag("-F", args, options.force_output_bits);        // Force 8, 16 or 32 (float) bit output file. Default same as input file
     procFlag("-I", args, options.save_intermediate_files);  // Saves various intermediate files for debugging
+    procFlag("-J", args, options.batch_jobs);               // -B images corrected at once, default a third of the cores
+    procFlag("-K", args, options.max_memory);               // memory budget in MB, images that won't fit are streamed (-O) within it
     procFlag("-N", args, options.gain_restore_scale);       // Increase RGB values by percentage of filter DC gain
+    procFlag("-O", args, options.streaming);                // stream image in two passes, full resolution memory is a few rows
     procFlag("-M", args, options.make_rgblab_cgats);        // Make rgb or rgblab cgats file for icc profile creation
     procFlag("-L", args, options.landscape);                // tif targets are in landscape, default is profile
     procFlag("-P", args, options.profile_name);             // optional file name of profile to attach to corrected image
+    procFlag("-Q", args, options.compact_storage);          // keep full resolution image as 16 bit linear or half floats
     procFlag("-R", args, options.simulate_reflected_light); // generate an image estimate of scanner's re-reflected light addition.
     procFlag("-S", args, options.edge_reflectance);         // average reflected light of area outside of scan crop (if black: .01)
     procFlag("-s", args, options.reflection_stats);         // read in standard scatter 35x29 chart and print metrics
     procFlag("-T", args, options.print_line_and_time);      // print line number and time since start for each major phase of process
+    procFlag("-U", args, options.use_correction_field);     // skip reflection estimate and apply saved infile.rcf
     procFlag("-W", args, options.adjust_to_detected_white); // Scales output values so that the largest .01% of pixels are maxed (255)
-
-    validate(options.force_output_bits == 0 || options.force_output_bits == 8 || options.force_output_bits == 16, "-F n:   n must be either 8 or 16");
+    procFlag("-X", args, options.sweep);                    // parameter sweep, ie: "N=0,50,100;S=.5,.85;C=cal_a.txt,cal_b.txt"
+    procFlag("-Z", args, options.compression);              // output tif compression: none, lzw, deflate, or zstd. Default same as input
+
+    validate(options.force_output_bits == 0 || options.force_output_bits == 8 || options.force_output_bits == 16 || options.force_output_bits == 32,
+        "-F n:   n must be 8, 16, or 32 (float)");
+    validate(options.max_memory >= 0, "-K MB:   memory budget must not be negative");
+    validate(options.compression == "" || compression_code(options.compression) != 0, "-Z compression must be none, lzw, deflate, or zstd");
+    CompactImage::Kind kind;
+    validate(options.compact_storage == "" || CompactImage::parse(options.compact_storage, kind), "-Q storage must be 16 or half");
 }
 
 void message_and_exit(string message)
@@ -62,164 +82,466 @@ void message_and_exit(string message)
         "  -A                                   Correct Image Already in Adobe RGB\n" <<
         "  -B tif file list                     Batch mode, auto renaming with _f\n" <<
         "  -C calibration_file                  Use scanner reflection calibration text file.\n" <<
+        "  -E                                   Also save reflection estimate as infile.rcf\n" <<
         "  -M[L] charts... measurefile outfile  Make CGATS, chart1.tif ... CGATSmeasure.txt and save CGATS.txt\n" <<
         "  -M[L] charts... outfile              Scan patch charts and save CGATs file\n" <<
         "  -P profile                           Attach profile <profile.icc>\n" <<
         "  -S edge_refl                         ave refl outside of scanned area (0 to 1, default: .85)\n" <<
         "  -s reflection.tif                    Calculate statistics on colors with white, gray and black surrounds\n" <<
-        "  -W                                   Maximize white (Like Relative Col with tint retention)\n\n" <<
+        "  -U                                   Use reflection estimate saved by -E in infile.rcf\n" <<
+        "  -W                                   Maximize white (Like Relative Col with tint retention)\n" <<
+        "  -Z none|lzw|deflate|zstd             Output compression (default: same as infile)\n\n" <<
         "                                       Advanced and Test options\n" <<
         "  -b batch_file                        text file with list of command lines to execute\n" <<
         "  -c scanner_cal.tif  [Y values]       Create scanner calibration file from reference scan.\n\n" <<
-        "  -F 8|16                              Force 8 or 16 bit tif output]\n" <<
+        "  -F 8|16|32                           Force 8, 16 or 32 bit (linear float) tif output]\n" <<
         "  -I                                   Save intermediate files\n" <<
+        "  -J n                                 -B images corrected at once, default a third of the cores\n" <<
+        "  -K MB                                Memory budget, images over it are streamed (-O) within it\n" <<
         "  -N gain                              Restore gain (default half of refl matrix gain)\n" <<
+        "  -O                                   Stream large images, two reads of infile, little memory\n" <<
+        "  -Q 16|half                           Keep image in 2 bytes a sample, 16 bit linear or half floats\n" <<
         "  -R                                   Simulated scanner by adding reflected light\n" <<
         "  -T                                   Show line numbers and accumulated time.\n" <<
+        "  -X \"N=0,50;S=.5,.85;C=a.txt,b.txt\"   Sweep -N, -S, -C values, one output per combination\n" <<
         "scannerreflfix.exe models and removes re-reflected light from an area\n"
         "approx 1\" around scanned RGB values for the document scanners.\n";
     exit(0);
 }
 
-void process_image(const string &image_in_raw, string image_out, Timer& timer)
+// Largest of the R, G, and B values exceeded by only .01% of the pixels in that channel
+// Each channel is histogrammed on its own thread, two O(N) passes and no copies
+float detected_white(const ArrayRGB& image)
 {
-    if (image_out.length() == 0)
-    {
-        options.save_intermediate_files = false;
-        options.print_line_and_time = false;
-        options.simulate_reflected_light = false;
-        auto name = file_parts(image_in_raw);
-        image_out = name.first + "_f.tif";
-    }
-    validate(file_is_tif(image_in_raw) && file_is_tif(image_out), "Only Tif files allowed");
-    if (options.simulate_reflected_light)
-        cout << "\nSimulating reflected light input: " << image_in_raw << "  out: " << image_out <<  "\n";
-    else
-        cout << "\nCorrecting reflected light input: " << image_in_raw << "  out: " << image_out <<  "\n";
-    static bool firstpass=true;
-    InterpolateRefl interpolate;
-    interpolate.read_init_file(options.calibration_file, firstpass);
-    if (firstpass)
-        firstpass=false;
+    auto channel_white = [&image](int color) {
+        const auto& v = image.v[color];
+        PercentileHistogram hist;
+        hist.clk(v.data(), v.size());
+        hist.select(hist.n() - (1 + hist.n() / 10000));
+        hist.clk_fine(v.data(), v.size());
+        return hist.value();
+    };
+    auto c0 = std::async(launchType, channel_white, 0);
+    auto c1 = std::async(launchType, channel_white, 1);
+    auto c2 = std::async(launchType, channel_white, 2);
+    return std::max({ c0.get(), c1.get(), c2.get(), 0.0f });
+}
 
-    // Increase RGB values by percentage of filter DC gain to optimize performance against uncorrected profiles
-    // clamp values between 0 and 100%
-    options.gain_restore_scale = std::clamp(options.gain_restore_scale, 0.0f, 100.0f);
+// Add 1" margin of edge_refl around image_in since re-reflected light model is limited to an inch
+// then downsize by 3, x3 times, and 2, x2 times. This does not require or need high resolution.
+// The full size image with margins is built in *expanded if given so it can be reused.
+ArrayRGB reduce_with_margins(const ArrayRGB& image_in, float edge_refl, int x2, int x3, ArrayRGB* expanded)
+{
+    int margins = image_in.dpi;
+    ArrayRGB local;
+    ArrayRGB& image_expanded = expanded ? *expanded : local;
+    int nc = image_in.nc + 2 * margins;
+    if (image_expanded.v[0].capacity() < size_t(image_in.nr + 2 * margins) * padded_pitch(nc))
+        image_expanded = ArrayRGB();    // free a smaller page's buffer first, its pixels aren't needed
+    image_expanded.resize(image_in.nr + 2 * margins, nc, x2 + x3 > 0 ? padded_pitch(nc) : nc);  // padded unless returned
+    image_expanded.dpi = image_in.dpi;
+    image_expanded.from_16bits = image_in.from_16bits;
+    image_expanded.gamma = image_in.gamma;
+    image_expanded.fill(edge_refl, edge_refl, edge_refl);    // assume border "white" reflected 85% of light.
+    image_expanded.copy(image_in, margins, margins);         // insert into expanded image with 1" margins
 
-    ArrayRGB image_in = TiffRead(image_in_raw.c_str(), options.correct_image_in_aRGB ? 2.2f : static_cast<float>(interpolate.gamma));
+    // Downsize image to create a reflected light version, use 3x downsize initially for speed
+    ArrayRGB image_reduced;
+    const ArrayRGB* from = &image_expanded;
+    for (; x3 > 0; x3--, from = &image_reduced)
+        image_reduced = downsample(*from, 3);
+    for (; x2 > 0; x2--, from = &image_reduced)
+        image_reduced = downsample(*from, 2);
+    return from == &image_reduced ? image_reduced : image_expanded;
+}
 
+// Estimate re-reflected light at low resolution from image with a 1" surround added.
+// Returned field is applied with apply_correction_field() and may be saved for reuse.
+// The full size work buffer is kept in the job's buffers for its next page
+CorrectionField make_correction_field(const ArrayRGB& image_in, Job& job)
+{
+    const InterpolateRefl& interpolate = *job.calibration;
     // Get image that represents the light spread that is additive to the center's pixel location
     // top_w: number of times DPI divisible by 2, x3:  number of times DPI divisible by 3
-    auto [refl_area, x2, x3] = getReflArea(image_in.dpi, interpolate);
-    if (options.print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
-
-    // Add 1" margin around image_in since re-reflected light model is limited to an inch
-    int margins = image_in.dpi;
-    ArrayRGB in_expanded{ image_in.nr + 2 * margins, image_in.nc + 2 * margins, image_in.dpi, image_in.from_16bits, image_in.gamma };
-    in_expanded.fill(options.edge_reflectance, options.edge_reflectance, options.edge_reflectance);             // assume border "white" reflected 85% of light.
-    in_expanded.copy(image_in, margins, margins);   // insert into expanded image with 1" margins
+    auto kernel = cached_kernel(interpolate, image_in.dpi);
+    const ArrayRGB& refl_area = kernel->refl_area;
+    int x2 = kernel->x2;
+    int x3 = kernel->x3;
+    if (job.options.print_line_and_time) job.log << __LINE__ << "  " << job.timer.stop() << endl;
+
+    // Create downsized image with surround to calculate reflected light from
+    ArrayRGB image_reduced = reduce_with_margins(image_in, job.options.edge_reflectance, x2, x3, &job.buffers.expanded);
+    if (job.options.print_line_and_time) job.log << __LINE__ << "  " << job.timer.stop() << endl;
+    report_memory(job, "reduce");
+    return field_from_reduced(image_reduced, image_in, refl_area, job);
+}
 
-                                                    // for getting estimated reflected light spread
-    if (options.save_intermediate_files)
+// Second half of make_correction_field(), the estimate from the reduced image with surround.
+// image_in only supplies the full resolution size, dpi and gamma so it may have no pixels.
+CorrectionField field_from_reduced(ArrayRGB& image_reduced, const ArrayRGB& image_in, const ArrayRGB& refl_area, Job& job)
+{
+    // for getting estimated reflected light spread
+    if (job.options.save_intermediate_files)
     {
-        cout << "Saving reflarray.tif, image of additional reflected light in gamma = 2.2" << endl;
-        refl_area.gamma = 1.0f;      // write gamma for compatibility with aRGB G=1
-        TiffWrite("reflArray.tif", refl_area, "");
+        job.log << "Saving reflArray.npy, image of additional reflected light" << endl;
+        dump_npy("reflArray.npy", ArrayRGB(refl_area));
     }
-    if (options.print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
-
-    // Create downsized image to calculate reflected light from
-    // This does not require or need high resolution.
-    ArrayRGB image_reduced = in_expanded;
     int reduction = image_in.dpi / refl_area.dpi;
 
-    // Downsize image to create a reflected light version, use 3x downsize initially for speed
-    while (x3--)
-        image_reduced = downsample(image_reduced, 3);
-    while (x2--)
-        image_reduced = downsample(image_reduced, 2);
-    if (options.print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
-
 
     // when logging, save downsampled file with added margin
-    if (options.save_intermediate_files)
+    if (job.options.save_intermediate_files)
     {
-        cout << "Saving imagorig.tif, reduced original file with surround in gamma=2.2" << endl;
-        image_reduced.gamma = 1.0f;      // write gamma for compatibility with aRGB G=1
-        TiffWrite("imageorig.tif", image_reduced, "");
+        job.log << "Saving imageorig.npy, reduced original file with surround" << endl;
+        dump_npy("imageorig.npy", ArrayRGB(image_reduced));
     }
 
     // Generate reflected light image.   time consuming operation, in debug 4 min for 8x10"
-    if (options.print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+    if (job.options.print_line_and_time) job.log << __LINE__ << "  " << job.timer.stop() << endl;
     ArrayRGB image_correction = generate_reflected_light_estimate(image_reduced, refl_area);
-    if (options.print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+    if (job.options.print_line_and_time) job.log << __LINE__ << "  " << job.timer.stop() << endl;
+    report_memory(job, "estimate");
 
     // save the estimated re-reflected light from the full scanned image and surround
-    if (options.save_intermediate_files)
+    if (job.options.save_intermediate_files)
     {
-        cout << "Saving refl_light.tif, image of estimated reflected light" << endl;
-        image_correction.gamma = 1.0f;      // write gamma for compatibility with aRGB G=1
-        TiffWrite("refl_light.tif", image_correction, "");
+        job.log << "Saving refl_light.npy, image of estimated reflected light" << endl;
+        dump_npy("refl_light.npy", ArrayRGB(image_correction));
     }
 
+    CorrectionField ret;
+    ret.image_nr = image_in.nr;
+    ret.image_nc = image_in.nc;
+    ret.image_dpi = image_in.dpi;
+    ret.reduction = reduction;
+    ret.gamma = image_in.gamma;
+    ret.edge_reflectance = job.options.edge_reflectance;
+    ret.calibration_hash = job.calibration->file_hash;
+    ret.field = std::move(image_correction);
+    return ret;
+}
+
+// Subtract (or with -R add) estimated re-reflected light from full resolution image.
+// image_in may be a band of the image's rows starting at first_row
+void apply_correction_field(ArrayRGB& image_in, const CorrectionField& correction, float refl_gain, const Options& options, int first_row)
+{
     // Subtract re-reflected light from original
+    const float gain_adj = 1.0f + (options.gain_restore_scale / 100.0f) * refl_gain;
+    const bool simulate = options.simulate_reflected_light;
     for (int color = 0; color < 3; color++)
     {
         for (int i = 0; i < image_in.nr; i++)
         {
+            float* row = image_in.row(i, color);
             for (int ii = 0; ii < image_in.nc; ii++)
             {
                 float tmp;
-                auto adj = bilinear(image_correction, i, ii, reduction, color) * image_in(i, ii, color);
-                auto gain_adj = 1.0f + (options.gain_restore_scale / 100.0f) * interpolate.gain_adj;
-                if (options.simulate_reflected_light)   // Special mode to simulate scanner by adding reflected light
+                auto adj = bilinear(correction.field, first_row + i, ii, correction.reduction, color) * row[ii];
+                if (simulate)   // Special mode to simulate scanner by adding reflected light
                 {
-                    tmp = image_in(i, ii, color) + adj;
+                    tmp = row[ii] + adj;
                     tmp /= gain_adj;
                 }
                 else
                 {
                     // gain restore  adjusts gain to offset reduction from re-reflected light subtraction
-                    tmp = image_in(i, ii, color) - adj;
+                    tmp = row[ii] - adj;
                     tmp = tmp * gain_adj;
                 }
 
-                image_in(i, ii, color) = std::clamp(tmp, 0.f, 1.f);
+                row[ii] = std::clamp(tmp, 0.f, 1.f);
             }
         }
     }
-    if (options.save_intermediate_files)
+}
+
+// Output name, checks and settings shared by process_image() and process_batch(), loading the
+// job's calibration if it has none. With no output name, as with -B, it is infile_f.tif and
+// -I, -T and -R are off.
+static void begin_image(const string& image_in_raw, string& image_out, Job& job)
+{
+    if (image_out.length() == 0)
     {
-        cout << "Saving Corrected Image: corrected.tif" << endl;
-        auto gamma = image_in.gamma;
-        image_in.gamma = 1.0f;      // write gamma for compatibility with aRGB G=1
-        TiffWrite("corrected.tif", image_in, "");
-        image_in.gamma = gamma;
+        job.options.save_intermediate_files = false;
+        job.options.print_line_and_time = false;
+        job.options.simulate_reflected_light = false;
+        auto name = file_parts(image_in_raw);
+        image_out = name.first + "_f.tif";
     }
+    // "-" is stdin or stdout for use in pipelines, messages then go to stderr so stdout is only the tif
+    validate((image_in_raw == "-" || file_is_tif(image_in_raw)) && (image_out == "-" || file_is_tif(image_out)), "Only Tif files allowed");
+    validate(image_in_raw != "-" || !(job.options.use_correction_field || job.options.export_correction_field), "-E and -U need a named input file");
+    if (image_out == "-")
+        reserve_stdout_for_tif();
+    if (job.options.simulate_reflected_light)
+        job.log << "\nSimulating reflected light input: " << image_in_raw << "  out: " << image_out <<  "\n";
+    else
+        job.log << "\nCorrecting reflected light input: " << image_in_raw << "  out: " << image_out <<  "\n";
 
-    // Adjust for Relative Colorimetric w/o shift to WP (no tint change)
-    // Should not be used to process scanner profiling patch scans
-    if (options.adjust_to_detected_white)
+    // Increase RGB values by percentage of filter DC gain to optimize performance against uncorrected profiles
+    // clamp values between 0 and 100%
+    job.options.gain_restore_scale = std::clamp(job.options.gain_restore_scale, 0.0f, 100.0f);
+
+    // Calibration is parsed once per process, its kernels are built once for each dpi
+    if (!job.calibration)
+        job.calibration = cached_calibration(job.options.calibration_file, true);
+
+    // Freed image buffers are kept for the next page or image, within a quarter of a -K budget
+    set_pool_limit(job.options.max_memory > 0 ? size_t(job.options.max_memory) * 1024 * 1024 / 4 : pool_default_limit);
+}
+
+// Correct a page in place. Its reflected light estimate is either calculated or read from
+// field_file, saved by an earlier -E run
+static void correct_page(ArrayRGB& image_in, const string& field_file, Job& job)
+{
+    const InterpolateRefl& interpolate = *job.calibration;
+    CorrectionField correction;
+    if (job.options.use_correction_field)
+    {
+        job.log << "Using saved reflection estimate: " << field_file << "\n";
+        correction.read(field_file);
+        correction.check_matches(image_in, interpolate.file_hash, job.options.edge_reflectance);
+    }
+    else
     {
-        float maxcolor = 0;
-        for (int i = 0; i < 3; i++)
+        correction = make_correction_field(image_in, job);
+        if (job.options.export_correction_field)
         {
-            vector<float> color(image_in.v[i]);
-            sort(color.begin(), color.end());
-            float high = *(color.end() - (1 + color.size() / 10000));
-            if (high > maxcolor) maxcolor = high;
+            job.log << "Saving reflection estimate: " << field_file << "\n";
+            correction.write(field_file);
         }
+    }
+    apply_correction_field(image_in, correction, interpolate.gain_adj, job.options);
+    report_memory(job, "correct");
+
+    if (job.options.save_intermediate_files)
+    {
+        job.log << "Saving Corrected Image: corrected.npy" << endl;
+        dump_npy("corrected.npy", ArrayRGB(image_in));
+    }
+}
+
+// TiffRead() of a page header leaves this note to the caller so it goes to the job's log
+static void note_8_bit_read(const TifInfo& page, Job& job)
+{
+    if (page.read_as_8_bits())
+        job.log << "16 bit tif file not recognized, reverting to 8 bit read.\n";
+}
+
+void process_image(const string &image_in_raw, string image_out, Job& job, const vector<TifInfo>* page_headers)
+{
+    begin_image(image_in_raw, image_out, job);
+
+    // Page headers are read with one open of the tif, unless -B already has them, and
+    // go to the memory plan and the readers
+    vector<TifInfo> read_headers;
+    if (!page_headers)
+        read_headers = TiffPages(image_in_raw.c_str());
+    const vector<TifInfo>& headers = page_headers ? *page_headers : read_headers;
+    validate(!headers.empty(), "Could not read " + image_in_raw);
+
+    // Single page images can be streamed a band of rows at a time instead of held in memory,
+    // -O and -Q always are and others are if correcting them in memory won't fit
+    float decode_gamma = job.options.correct_image_in_aRGB ? 2.2f : static_cast<float>(job.calibration->gamma);
+    MemoryPlan plan = plan_memory(headers, image_out, job);
+    if (plan.stream && stream_image(image_in_raw, image_out, job, plan))
+        return;
+
+    // Multi-page tifs are corrected a page at a time into a multi-page output. The next page is
+    // decoded while the current one is corrected and the reflection kernel and work buffers are reused.
+    int pages = int(headers.size());
+    if (pages > 1)
+        job.log << pages << " pages\n";
+    auto read_page = [&image_in_raw, &headers, decode_gamma](int page) { return TiffRead(image_in_raw.c_str(), decode_gamma, headers[page]); };
+    std::future<ArrayRGB> next_page = std::async(launchType, read_page, 0);
+    std::unique_ptr<TiffPageWriter> pages_out;
+    string field_base = image_in_raw == "-" ? "" : file_parts(image_in_raw).first;
+    for (int page = 0; page < pages; page++)
+    {
+        ArrayRGB image_in = next_page.get();
+        validate(image_in.nc > 0 && image_in.nr > 0, "Could not read " + image_in_raw);
+        note_8_bit_read(headers[page], job);
+        if (page + 1 < pages)
+            next_page = std::async(launchType, read_page, page + 1);
+        report_memory(job, "read");
+
+        string field_file = field_base + (pages > 1 ? "_p" + std::to_string(page + 1) : "") + ".rcf";
+        correct_page(image_in, field_file, job);
+
+        if (pages == 1)
+            write_corrected_image(image_in, image_out, job);
+        else
+        {
+            prepare_corrected_image(image_in, job);
+            if (!pages_out)
+                pages_out = std::make_unique<TiffPageWriter>(image_out.c_str(), image_in, pages);
+            pages_out->write(image_in, job.options.profile_name);
+            if (job.options.print_line_and_time) job.log << __LINE__ << "  " << job.timer.stop() << endl;
+        }
+        report_memory(job, "write");
+    }
+    if (pages_out)
+        pages_out->close();
+}
+
+// -B on one worker, a three stage pipeline: the next file is decoded and the previous one
+// encoded and written while the current one is corrected. Each stage hands on one image at a
+// time and waits for the next stage to take it, so at most three images are held. Files that
+// are streamed, multi-page, or too large for three images in the memory budget are corrected
+// alone by process_image() once the previous write has finished.
+static void pipeline_batch(const vector<string>& files, Job& job)
+{
+    float decode_gamma = job.options.correct_image_in_aRGB ? 2.2f : static_cast<float>(job.calibration->gamma);
+    auto output_name = [](const string& file) { return file_parts(file).first + "_f.tif"; };
+
+    vector<vector<TifInfo>> headers(files.size());
+    vector<bool> pipelined(files.size());
+    std::future<ArrayRGB> next_read;
+    auto start_read = [&](size_t i) {
+        if (file_is_tif(files[i]))
+            headers[i] = TiffPages(files[i].c_str());
+        pipelined[i] = fits_batch_pipeline(headers[i], output_name(files[i]), job.options);
+        if (pipelined[i])
+            next_read = std::async(launchType, [&files, &page = headers[i][0], i, decode_gamma]() { return TiffRead(files[i].c_str(), decode_gamma, page); });
+    };
+    std::future<void> writing;
+    auto finish_write = [&writing]() {
+        if (writing.valid())
+            writing.get();
+    };
+
+    if (!files.empty())
+        start_read(0);
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (!pipelined[i])
+        {
+            finish_write();
+            process_image(files[i], "", job, &headers[i]);
+            if (i + 1 < files.size())
+                start_read(i + 1);
+            continue;
+        }
+        string image_out;
+        begin_image(files[i], image_out, job);
+        ArrayRGB image_in = next_read.get();
+        note_8_bit_read(headers[i][0], job);
+        if (i + 1 < files.size())
+            start_read(i + 1);
+        correct_page(image_in, file_parts(files[i]).first + ".rcf", job);
+        prepare_corrected_image(image_in, job);
+
+        finish_write();         // one image waiting to be written at a time
+        writing = std::async(launchType, [image = std::move(image_in), image_out, profile = job.options.profile_name]() {
+            TiffWrite(image_out.c_str(), image, profile);
+        });
+    }
+    finish_write();
+}
+
+// -B, files are corrected as concurrent jobs, -J at a time or a third of the cores since each
+// job corrects its colors on three threads. A job starts when a worker is free and its estimated
+// peak memory and those of the running jobs are within 3/4 of the -K budget or physical memory.
+// Each job's messages are kept until it finishes and printed in file order. Files that are
+// streamed, multi-page or can't be read are corrected alone once the running jobs finish.
+// On a single worker the files go through pipeline_batch() instead.
+void process_batch(const vector<string>& files, const Options& settings, const Timer& timer)
+{
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    size_t workers = settings.batch_jobs > 0 ? size_t(settings.batch_jobs) : std::max(1u, cores / 3);
+    auto calibration = cached_calibration(settings.calibration_file, true);
+    if (workers == 1 || files.size() < 2)
+    {
+        Job job(settings, timer, cout);
+        job.calibration = calibration;
+        pipeline_batch(files, job);
+        return;
+    }
+    std::size_t budget = memory_budget(settings);
+    std::size_t limit = budget - budget / 4;
+
+    struct Running {
+        std::unique_ptr<std::ostringstream> log;
+        std::future<void> done;
+        std::size_t bytes;
+    };
+    std::deque<Running> running;
+    std::size_t in_use = 0;
+    auto finish_oldest = [&running, &in_use]() {
+        Running oldest = std::move(running.front());
+        running.pop_front();
+        oldest.done.wait();
+        cout << oldest.log->str();
+        in_use -= oldest.bytes;
+        oldest.done.get();      // rethrows the job's error
+    };
+
+    for (const string& file : files)
+    {
+        vector<TifInfo> headers = file_is_tif(file) ? TiffPages(file.c_str()) : vector<TifInfo>();
+        std::size_t bytes = batch_image_bytes(headers, file_parts(file).first + "_f.tif", settings);
+        if (bytes == 0)
+        {
+            while (!running.empty())
+                finish_oldest();
+            Job job(settings, timer, cout);
+            job.calibration = calibration;
+            process_image(file, "", job, &headers);
+            continue;
+        }
+        while (!running.empty() && (running.size() >= workers || (budget != 0 && in_use + bytes > limit)))
+            finish_oldest();
+        Running started{ std::make_unique<std::ostringstream>(), {}, bytes };
+        started.done = std::async(launchType, [&settings, &timer, file, headers = std::move(headers), log = started.log.get(), calibration]() {
+            Job job(settings, timer, *log);
+            job.calibration = calibration;
+            process_image(file, "", job, &headers);
+        });
+        in_use += bytes;
+        running.push_back(std::move(started));
+    }
+    while (!running.empty())
+        finish_oldest();
+}
+
+// Apply -W, -F and -Z options to a corrected image before it is saved
+void prepare_corrected_image(ArrayRGB& image_in, Job& job)
+{
+    // Adjust for Relative Colorimetric w/o shift to WP (no tint change)
+    // Should not be used to process scanner profiling patch scans
+    if (job.options.adjust_to_detected_white)
+    {
+        float maxcolor = detected_white(image_in);
         image_in.scale(1 / maxcolor);
     }
 
-    if (options.print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
-    if (options.force_output_bits == 16)
-        image_in.from_16bits = true;
-    else if (options.force_output_bits == 8)
-        image_in.from_16bits = false;
+    if (job.options.print_line_and_time) job.log << __LINE__ << "  " << job.timer.stop() << endl;
+    set_output_format(image_in, job);
+}
+
+// Apply -F and -Z to the format an image is written in, noting in the job's log if libtiff lacks the compression
+void set_output_format(ArrayRGB& image, Job& job)
+{
+    if (job.options.force_output_bits != 0)
+    {
+        image.from_16bits = job.options.force_output_bits == 16;
+        image.from_float = job.options.force_output_bits == 32;
+    }
+    if (job.options.compression != "")
+        image.compression = compression_code(job.options.compression);
+    if (!compression_available(image.compression))
+    {
+        job.log << "Compression " << image.compression << " not available in libtiff, writing uncompressed tif.\n";
+        image.compression = COMPRESSION_NONE;
+    }
+}
 
-    TiffWrite(image_out.c_str(), image_in, options.profile_name);
-    if (options.print_line_and_time) cout << __LINE__ << "  " << timer.stop() << endl;
+// Apply -W, -F and -Z options then save corrected image with optional -P profile
+void write_corrected_image(ArrayRGB& image_in, const string& image_out, Job& job)
+{
+    prepare_corrected_image(image_in, job);
+    TiffWrite(image_out.c_str(), image_in, job.options.profile_name);
+    if (job.options.print_line_and_time) job.log << __LINE__ << "  " << job.timer.stop() << endl;
 }
 
 
@@ -380,6 +702,7 @@ void get_scatter_stats(string filename) //  file is tif scatter chart
     std::cout << "File:" << filename << " ,Rows:" << patches.charts[0].rows
         << ", Cols:" << patches.charts[0].cols << "\n";
 
+    validate(patches.charts[0].rows == 35 && patches.charts[0].cols == 29, "Scatter chart must be 35 rows by 29 columns of patches");
     array<array<array<Statistics,3>, 6>, 2> stats;      // R G B C Y M and w g9 g8 g7 g6 g5 rgb stats
     Array2D<V3> rgb(35,29,patches.rgb255.data(), false);
     for (int i = 0; i < 2; i++)                     // colors v neutrals
@@ -29,6 +29,7 @@ SOFTWARE.
 #include <fstream>
 #include <algorithm>
 #include <future>
+#include <memory>
 #include "ArgumentParse.h"
 #include "tiffresults.h"
 #include "interpolate.h"
@@ -38,10 +39,41 @@ SOFTWARE.
 #include "validation.h"
 #include "cgats.h"
 #include "statistics.h"
+#include "percentile.h"
+#include "CorrectionField.h"
 
 extern struct Options options;
+struct MemoryPlan;
 
-void process_image(const std::string &image_in_raw, std::string image_out, Timer& timer);
+// Full size work buffer kept between images, ie: pages of a tif. Kernels are in the process cache
+struct CorrectionBuffers {
+    ArrayRGB expanded;      // image with 1" surround before downsizing
+};
+
+// One image's correction. The pipeline reads its settings, calibration and buffers from here
+// and writes messages to log rather than to the global options and cout, so with -B several
+// jobs run at once. Pool and cache figures printed with -T are for the whole process.
+struct Job {
+    Options options;
+    std::shared_ptr<const InterpolateRefl> calibration;     // loaded by process_image() if empty
+    CorrectionBuffers buffers;
+    Timer timer;
+    std::ostream& log;
+    Job(const Options& options, const Timer& timer, std::ostream& log) : options(options), timer(timer), log(log) {}
+};
+
+float detected_white(const ArrayRGB& image);
+ArrayRGB reduce_with_margins(const ArrayRGB& image_in, float edge_refl, int x2, int x3, ArrayRGB* expanded = nullptr);
+CorrectionField make_correction_field(const ArrayRGB& image_in, Job& job);
+CorrectionField field_from_reduced(ArrayRGB& image_reduced, const ArrayRGB& image_in, const ArrayRGB& refl_area, Job& job);
+void apply_correction_field(ArrayRGB& image_in, const CorrectionField& correction, float refl_gain, const Options& options, int first_row = 0);
+void process_image(const std::string &image_in_raw, std::string image_out, Job& job, const std::vector<TifInfo>* page_headers = nullptr);
+void process_batch(const std::vector<std::string>& files, const Options& settings, const Timer& timer);
+bool stream_image(const std::string& image_in_raw, const std::string& image_out, Job& job, const MemoryPlan& plan);
+void sweep_image(const std::string& image_in_raw, const std::string& image_out, Job& job);
+void prepare_corrected_image(ArrayRGB& image_in, Job& job);
+void set_output_format(ArrayRGB& image, Job& job);
+void write_corrected_image(ArrayRGB& image_in, const std::string& image_out, Job& job);
 void process_args(std::vector<std::string>& args, Options& options);
 std::pair<std::vector<std::string>, Options> process_a_command_line(std::vector<std::string> args);
 void message_and_exit(std::string message);
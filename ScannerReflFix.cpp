@@ -35,6 +35,8 @@ SOFTWARE.
 #include "validation.h"
 #include "cgats.h"
 #include "Refl_helpers.h"
+#include "DebugDump.h"
+#include "ProcessCache.h"
 
 
 using std::vector;
@@ -59,7 +61,7 @@ int main(int argc, char const** argv)
     {
         vector<vector<string>> argList{cmdArgs};
         process_args(cmdArgs, options);
-        validate(options.force_output_bits == 0 || options.force_output_bits == 8 || options.force_output_bits == 16, "-F n:   n must be either 8 or 16");
+        validate(options.force_output_bits == 0 || options.force_output_bits == 8 || options.force_output_bits == 16 || options.force_output_bits == 32, "-F n:   n must be 8, 16, or 32 (float)");
 
         // use batch file list of commands if -b "batchfile.txt" selected
         if (options.batch_file != "")
@@ -76,7 +78,7 @@ int main(int argc, char const** argv)
             // load a new Options with defaults then set exec directory
             process_args(cmdLine, options);
             validate(cmdLine.size() != 0 || options.batch_file != "", "command line error");
-            validate(options.force_output_bits == 0 || options.force_output_bits == 8 || options.force_output_bits == 16, "-F n:   n must be either 8 or 16");
+            validate(options.force_output_bits == 0 || options.force_output_bits == 8 || options.force_output_bits == 16 || options.force_output_bits == 32, "-F n:   n must be 8, 16, or 32 (float)");
 
             // UTILITY: Process scanned target and optionally CGATs measurement
             if (options.make_rgblab_cgats)
@@ -95,14 +97,17 @@ int main(int argc, char const** argv)
             {
                 // remove (or add) reflections from first file and save to second file
                 validate(cmdLine.size() == 2, "Arguments must include input tif file and output tif file");
-                process_image(cmdLine[0], cmdLine[1], timer);
+                Job job(options, timer, cout);
+                if (options.sweep != "")
+                    sweep_image(cmdLine[0], cmdLine[1], job);
+                else
+                    process_image(cmdLine[0], cmdLine[1], job);
             }
             else
             {
                 // remove (or add) reflections from 1, 3 or more files, rename with "_f" appended
                 validate(cmdLine.size() >= 1, "Arguments must include 1 or more input tif files");
-                for (int i = 0; i < int(cmdLine.size()); i++)
-                    process_image(cmdLine[i], "", timer);
+                process_batch(cmdLine, options, timer);
             }
         }
     }
@@ -120,6 +125,15 @@ int main(int argc, char const** argv)
         cout << "unknown exception" << std::endl;
         exit(-1);
     }
+    wait_for_dumps();
+    if (options.print_line_and_time)
+    {
+        PoolCounters pc = pool_counters();
+        cout << "Buffer pool: " << pc.reused << " of " << pc.allocations << " image buffers reused, "
+            << pc.bytes_reused / (1024 * 1024) << " MB not reallocated, " << pc.released << " released" << endl;
+        CacheCounters cc = cache_counters();
+        cout << "Process cache: " << cc.hits << " of " << cc.lookups << " calibration, kernel and profile lookups reused" << endl;
+    }
     cout << "Execution Time: " << timer.stop() << endl;
 }
 
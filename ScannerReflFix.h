@@ -32,7 +32,7 @@ struct Options {
     std::string batch_file = "";                    // Batch file mode, read commands from file
     std::string calibration_file = "scanner_cal.txt";// Default Scanner reflection calibration text file
     bool scanner_cal = false;                       // Scanner reflection calibration tif file
-    int force_output_bits = 0;                      // Force 16 bit output file. 8 bit input files default to 8 bit output files
+    int force_output_bits = 0;                      // Force 8, 16 or 32 (float) bit output file. Default same as input file
     bool save_intermediate_files = false;           // Saves various intermediate files for debugging
     float gain_restore_scale = 50.0f;               // Increase RGB values by percentage of filter DC gain
     bool make_rgblab_cgats = false;                 // Make rgb or rgblab cgats file for icc profile creation
@@ -43,6 +43,14 @@ struct Options {
     bool reflection_stats =false;                   // read in standard scatter 35x29 chart and print metrics
     bool print_line_and_time = false;               // print line number and time since start for each major phase of process
     bool adjust_to_detected_white = false;          // Scales output values so that the largest .01% of pixels are maxed (255)
+    bool export_correction_field = false;           // save re-reflected light estimate as infile.rcf for later -U runs
+    bool use_correction_field = false;              // skip reflection estimate and apply saved infile.rcf
+    std::string sweep = "";                         // parameter sweep, ie: "N=0,50,100;S=.5,.85;C=cal_a.txt,cal_b.txt"
+    std::string compression = "";                   // output tif compression: none, lzw, deflate, or zstd. Default same as input
+    bool streaming = false;                         // stream image in two passes, full resolution memory is a few rows
+    int max_memory = 0;                             // memory budget in MB, 0 for physical memory
+    std::string compact_storage = "";               // -Q 16 or half, keep the full resolution image in 2 bytes a sample
+    int batch_jobs = 0;                             // -B images corrected at once, 0 for a third of the cores
 };
 
 
@@ -0,0 +1,528 @@
+/*
+Copyright (c) <2020> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+#define _CRT_SECURE_NO_WARNINGS
+
+// -O streaming correction for images too large to hold in memory.
+// Pass 1 reads the tif a band of rows at a time, adds the 1" surround a row at a
+// time and reduces it with a chain of row downsamplers, so only the reduced image
+// and a few rows per stage are kept. The reflected light estimate is then made as
+// usual and pass 2 reads the bands again, corrects and writes them. -W needs the
+// white point of the corrected image so adds two passes to histogram it.
+// With a -K memory budget band sizes are picked from the budget, the estimate is
+// made and applied a band at a time with a 1" halo and when the reduced image is
+// too large for the budget it and the estimate are kept in temp files.
+// Results are identical to process_image().
+// -Q keeps the image packed in 2 bytes a sample from pass 1 so the later passes
+// unpack it from memory instead of decoding the tif again.
+
+#include <filesystem>
+#include <chrono>
+#include "Refl_helpers.h"
+#include "DebugDump.h"
+#include "CompactImage.h"
+#include "MemoryBudget.h"
+#include "ProcessCache.h"
+
+using std::string;
+using std::vector;
+using std::array;
+using std::cout;
+using std::endl;
+
+// One plane of downsample(ArrayRGB, rate) computed a row at a time. Only the last
+// input rows the 5x5 gaussian needs are kept, extended by the same edge duplication.
+class RowDownsampler {
+    int in_nr, in_nc, rate;
+    int out_nr, out_nc;
+    int rows_in = 0;                // input rows pushed
+    int rows_out = 0;               // output rows made
+    vector<vector<float>> ring;     // column extended input rows, indexed by row % ring.size()
+    vector<float> out_row;
+    static int xtra(int rc, int rate)   // extra row/col elements, as downsample()
+    {
+        auto resid = (rc - 1) % rate;
+        return resid == 0 ? 0 : rate - resid;
+    }
+    const vector<float>& ext_row(int r) const   // row r of downsample()'s fromEx
+    {
+        return ring[std::clamp(r - 2, 0, in_nr - 1) % ring.size()];
+    }
+public:
+    RowDownsampler(int in_nr, int in_nc, int rate) : in_nr(in_nr), in_nc(in_nc), rate(rate), ring(8)
+    {
+        out_nr = out_size(in_nr, rate);
+        out_nc = out_size(in_nc, rate);
+        for (auto& x : ring)
+            x.resize(in_nc + 4 + xtra(in_nc, rate));
+        out_row.resize(out_nc);
+    }
+    static int out_size(int n, int rate) { return (n + 4 + xtra(n, rate) - (rate == 2 ? 3 : 2)) / rate; }
+    int rows() const { return out_nr; }
+    int cols() const { return out_nc; }
+
+    // Add the next input row, calling emit(out_row) for each output row it completes
+    template<class F>
+    void push(const float* row, F emit)
+    {
+        vector<float>& ext = ring[rows_in % ring.size()];
+        std::fill(ext.begin(), ext.begin() + 2, row[0]);
+        std::copy(row, row + in_nc, ext.begin() + 2);
+        std::fill(ext.begin() + 2 + in_nc, ext.end(), row[in_nc - 1]);
+        rows_in++;
+        // fspecial('gaussian',5,1.2), summed in the same order as downsample() so results are identical
+        static const std::array<std::array<float, 5>, 5> smooth{
+            0.007332f, 0.020779f, 0.029406f, 0.020779f, 0.007332f,
+            0.020779f, 0.058888f, 0.083334f, 0.058888f, 0.020779f,
+            0.029406f, 0.083334f, 0.117928f, 0.083334f, 0.029406f,
+            0.020779f, 0.058888f, 0.083334f, 0.058888f, 0.020779f,
+            0.007332f, 0.020779f, 0.029406f, 0.020779f, 0.007332f };
+        while (rows_out < out_nr && std::min(rate * rows_out + 2, in_nr - 1) < rows_in)
+        {
+            int xs = rate * rows_out;
+            const vector<float>* from[5];
+            for (int i = 0; i < 5; i++)
+                from[i] = &ext_row(xs + i);
+            for (int y = 0; y < out_nc; y++)
+            {
+                int ys = rate * y;
+                float prodsum = 0;
+                for (int i = 0; i < 5; i++)
+                    for (int j = 0; j < 5; j++)
+                        prodsum += smooth[i][j] * (*from[i])[ys + j];
+                out_row[y] = prodsum;
+            }
+            rows_out++;
+            emit(out_row.data());
+        }
+    }
+};
+
+// Rows of a low resolution image held in memory or, for -K budgets too small for it,
+// written to a temp file per color and mapped for reading. Each color's rows are
+// written in order, possibly from separate threads, then read back in bands.
+class RowStore {
+    ArrayRGB image;                 // size, dpi, etc. and the pixels if not spilled
+    bool spilled;
+    array<FILE*, 3> files{};
+    array<string, 3> names;
+    array<std::unique_ptr<MappedFile>, 3> mapped;
+public:
+    RowStore(const ArrayRGB& format, bool spill) : image(format), spilled(spill)
+    {
+        if (!spilled)
+        {
+            image.resize(format.nr, format.nc);
+            return;
+        }
+        image.resize(0, 0);
+        image.nr = format.nr;
+        image.nc = format.nc;
+        image.pitch = format.nc;
+        auto unique = std::chrono::steady_clock::now().time_since_epoch().count();
+        for (int color = 0; color < 3; color++)
+        {
+            names[color] = (std::filesystem::temp_directory_path() / ("srf_" + std::to_string(unique) + "_" + std::to_string(color) + ".tmp")).string();
+            files[color] = fopen(names[color].c_str(), "wb");
+            if (files[color] == nullptr)
+                throw "Could not open temp file";
+        }
+    }
+    ~RowStore()
+    {
+        for (int color = 0; color < 3; color++)
+        {
+            mapped[color].reset();
+            if (files[color])
+                fclose(files[color]);
+            if (!names[color].empty())
+                std::remove(names[color].c_str());
+        }
+    }
+    RowStore(const RowStore&) = delete;
+    RowStore& operator=(const RowStore&) = delete;
+    int nr() const { return image.nr; }
+    int nc() const { return image.nc; }
+    const ArrayRGB& format() const { return image; }
+    void write(int color, int row, const float* data)
+    {
+        if (!spilled)
+            std::copy(data, data + image.nc, image.v[color].begin() + size_t(row) * image.nc);
+        else if (fwrite(data, sizeof(float), image.nc, files[color]) != size_t(image.nc))
+            throw "Error writing temp file";
+    }
+    void close()    // after the last row is written
+    {
+        if (!spilled)
+            return;
+        for (int color = 0; color < 3; color++)
+        {
+            if (fclose(files[color]) != 0)
+                throw "Error writing temp file";
+            files[color] = nullptr;
+            mapped[color] = std::make_unique<MappedFile>(names[color].c_str());
+            if (!mapped[color]->is_open() || mapped[color]->size() < uint64_t(image.nr) * image.nc * sizeof(float))
+                throw "Could not map temp file";
+        }
+    }
+    ArrayRGB rows(int first, int last) const    // copy of rows [first, last)
+    {
+        ArrayRGB ret(last - first, image.nc, image.dpi, image.from_16bits, image.gamma);
+        for (int color = 0; color < 3; color++)
+        {
+            const float* from = spilled ? reinterpret_cast<const float*>(mapped[color]->data()) : image.v[color].data();
+            std::copy(from + size_t(first) * image.nc, from + size_t(last) * image.nc, ret.v[color].begin());
+        }
+        return ret;
+    }
+    ArrayRGB take()     // the whole image, not spilled only
+    {
+        return std::move(image);
+    }
+};
+
+// One plane of reduce_with_margins() fed the image a row at a time
+class PlaneReducer {
+    vector<RowDownsampler> stages;  // x3 3x downsizes then x2 2x downsizes
+    RowStore& reduced;
+    int color;
+    int reduced_rows = 0;
+    void push(size_t stage, const float* row)
+    {
+        if (stage == stages.size())
+        {
+            reduced.write(color, reduced_rows++, row);
+            return;
+        }
+        stages[stage].push(row, [this, stage](const float* out) { push(stage + 1, out); });
+    }
+public:
+    PlaneReducer(int nr, int nc, int x2, int x3, RowStore& reduced, int color) : reduced(reduced), color(color)
+    {
+        for (int i = 0; i < x3 + x2; i++)
+        {
+            stages.emplace_back(nr, nc, i < x3 ? 3 : 2);
+            nr = stages.back().rows();
+            nc = stages.back().cols();
+        }
+    }
+    void push(const float* row) { push(0, row); }
+};
+
+// Size, dpi, etc. of the reduced image with surround reduce_with_margins() would make, with no pixels
+static ArrayRGB reduced_format(const ArrayRGB& format, int x2, int x3)
+{
+    int margins = format.dpi;
+    int nr = format.nr + 2 * margins;
+    int nc = format.nc + 2 * margins;
+    ArrayRGB image_reduced;     // downsample()'s defaults unless there are no downsizes
+    image_reduced.dpi = format.dpi;
+    if (x3 + x2 == 0)
+    {
+        image_reduced.from_16bits = format.from_16bits;
+        image_reduced.gamma = format.gamma;
+    }
+    for (int i = 0; i < x3 + x2; i++)
+    {
+        int rate = i < x3 ? 3 : 2;
+        nr = RowDownsampler::out_size(nr, rate);
+        nc = RowDownsampler::out_size(nc, rate);
+        image_reduced.dpi /= rate;
+    }
+    image_reduced.nr = nr;      // no pixels
+    image_reduced.nc = nc;
+    image_reduced.pitch = nc;
+    return image_reduced;
+}
+
+// Pass 1, the reduced image with surround as reduce_with_margins() would make it from the whole image.
+// Bands are also packed into keep if given.
+static void stream_reduce_with_margins(TiffRowReader& reader, float edge_refl, int x2, int x3, RowStore& image_reduced, CompactImage* keep)
+{
+    const ArrayRGB& format = reader.format();
+    int margins = format.dpi;
+    int nr = format.nr + 2 * margins;
+    int nc = format.nc + 2 * margins;
+
+    // each color's rows are reduced on its own thread, a band at a time
+    vector<std::unique_ptr<PlaneReducer>> planes;
+    for (int color = 0; color < 3; color++)
+        planes.push_back(std::make_unique<PlaneReducer>(nr, nc, x2, x3, image_reduced, color));
+    vector<float> margin_row(nc, edge_refl);
+    auto push_margin = [&planes, &margin_row, margins](int color) {
+        for (int r = 0; r < margins; r++)
+            planes[color]->push(margin_row.data());
+    };
+    auto push_band = [&planes, margins, nc](const ArrayRGB& band, int color, vector<float>& row) {
+        for (int r = 0; r < band.nr; r++)
+        {
+            std::copy(band.v[color].begin() + size_t(r) * band.nc, band.v[color].begin() + size_t(r + 1) * band.nc, row.begin() + margins);
+            planes[color]->push(row.data());
+        }
+    };
+    array<vector<float>, 3> rows{ margin_row, margin_row, margin_row };  // image rows with side margins
+    for (int color = 0; color < 3; color++)
+        push_margin(color);
+    ArrayRGB band;
+    int first_row = 0;
+    reader.rewind();
+    while (reader.read(band) > 0)
+    {
+        auto c0 = std::async(launchType, push_band, std::cref(band), 0, std::ref(rows[0]));
+        auto c1 = std::async(launchType, push_band, std::cref(band), 1, std::ref(rows[1]));
+        auto c2 = std::async(launchType, push_band, std::cref(band), 2, std::ref(rows[2]));
+        c0.get(); c1.get(); c2.get();
+        if (keep)
+            keep->store(first_row, band);
+        first_row += band.nr;
+    }
+    for (int color = 0; color < 3; color++)
+        push_margin(color);
+    image_reduced.close();
+}
+
+// generate_reflected_light_estimate() a band of rows at a time, each from the reduced rows
+// under it plus the reflection matrix's 1" halo, so only a few bands are in memory
+static void stream_reflected_light_estimate(const RowStore& image_reduced, const ArrayRGB& refl_area, RowStore& field, int band_rows)
+{
+    int halo = refl_area.nr - 1;
+    for (int first = 0; first < field.nr(); first += band_rows)
+    {
+        int last = std::min(field.nr(), first + band_rows);
+        ArrayRGB band = generate_reflected_light_estimate(image_reduced.rows(first, last + halo), refl_area);
+        for (int color = 0; color < 3; color++)
+            for (int r = 0; r < band.nr; r++)
+                field.write(color, first + r, &band.v[color][size_t(r) * band.nc]);
+    }
+    field.close();
+}
+
+// Correction field for the whole image, or with a -K budget, rows of it read from field_rows as needed
+struct StreamedField {
+    CorrectionField correction;
+    std::unique_ptr<RowStore> field_rows;
+};
+
+// Bands of the full resolution image for the passes after the first, decoded from the tif
+// or with -Q unpacked from the compact copy made in pass 1
+class BandSource {
+    TiffRowReader& reader;
+    const CompactImage* compact;
+    int band_rows;
+    int next_row = 0;
+public:
+    BandSource(TiffRowReader& reader, const CompactImage* compact, int band_rows) : reader(reader), compact(compact), band_rows(band_rows) {}
+    int read(ArrayRGB& band)
+    {
+        if (!compact)
+            return reader.read(band);
+        int rows = std::min(band_rows, compact->format().nr - next_row);
+        if (rows <= 0)
+            return 0;
+        compact->load(next_row, rows, band);
+        next_row += rows;
+        return rows;
+    }
+    void rewind() { reader.rewind(); next_row = 0; }
+};
+
+// Correct the next band from source, returns its first row or -1 after the last band
+static int read_corrected_band(BandSource& source, ArrayRGB& band, int& next_row, const StreamedField& field, float refl_gain, const Options& options)
+{
+    int rows = source.read(band);
+    if (rows == 0)
+        return -1;
+    if (!field.field_rows)
+        apply_correction_field(band, field.correction, refl_gain, options, next_row);
+    else
+    {
+        // field rows bilinear() reads for this band, one more than needed unless at the bottom
+        int reduction = field.correction.reduction;
+        int first = next_row / reduction;
+        int last = std::min((next_row + rows - 1) / reduction + 1, field.field_rows->nr() - 1);
+        CorrectionField part = field.correction;
+        part.field = field.field_rows->rows(first, last + 1);
+        apply_correction_field(band, part, refl_gain, options, next_row - first * reduction);
+    }
+    next_row += rows;
+    return next_row - rows;
+}
+
+// As process_image() for one page, keeping a band of rows of the full resolution image in memory.
+// With plan.compact the image is kept as -Q after its first read instead of decoded for each pass.
+// Returns false without doing anything if the plan found the tif can't be streamed.
+bool stream_image(const string& image_in_raw, const string& image_out, Job& job, const MemoryPlan& plan)
+{
+    if (!plan.streamable)
+    {
+        job.log << "Tif can't be streamed, processing in memory\n";
+        return false;
+    }
+    const InterpolateRefl& interpolate = *job.calibration;
+    float decode_gamma = job.options.correct_image_in_aRGB ? 2.2f : static_cast<float>(interpolate.gamma);
+    TiffRowReader reader(image_in_raw.c_str(), decode_gamma);
+    const ArrayRGB& format = reader.format();
+    validate(reader.streamable() && format.nc > 0 && format.nr > 0, "Could not read " + image_in_raw);
+
+    // -K budget, half for full resolution bands at about 48 bytes a pixel, a quarter for low resolution bands.
+    // The reduced image and estimate are only made in bands when -E and -I don't need them whole.
+    size_t budget = size_t(job.options.max_memory) << 20;
+    bool banded = budget != 0 && !job.options.export_correction_field && !job.options.save_intermediate_files;
+    int band_rows = budget == 0 ? 256 : int(std::min<size_t>(format.nr, std::max<size_t>(1, budget / 2 / (size_t(format.nc) * 48))));
+    if (budget != 0)
+        reader.set_band_rows(band_rows);
+
+    // -Q, the image is kept packed from its first read
+    std::unique_ptr<CompactImage> compact;
+    if (plan.compact)
+    {
+        CompactImage::Kind kind;
+        CompactImage::parse(job.options.compact_storage, kind);
+        compact = std::make_unique<CompactImage>(format, kind);
+        job.log << "Keeping image as " << (kind == CompactImage::Kind::half ? "half floats" : "16 bit linear")
+            << ", " << (compact->bytes() >> 20) << "MB\n";
+    }
+
+    // Reflected light estimate is either calculated or read from an earlier -E run
+    string field_file = (image_in_raw == "-" ? "" : file_parts(image_in_raw).first) + ".rcf";
+    StreamedField field;
+    CorrectionField& correction = field.correction;
+    if (job.options.use_correction_field)
+    {
+        job.log << "Using saved reflection estimate: " << field_file << "\n";
+        correction.read(field_file);
+        correction.check_matches(format, interpolate.file_hash, job.options.edge_reflectance);
+        if (compact)
+        {
+            ArrayRGB band;
+            reader.rewind();
+            for (int first_row = 0; reader.read(band) > 0; first_row += band.nr)
+                compact->store(first_row, band);
+        }
+    }
+    else
+    {
+        auto kernel = cached_kernel(interpolate, format.dpi);
+        const ArrayRGB& refl_area = kernel->refl_area;
+        int x2 = kernel->x2;
+        int x3 = kernel->x3;
+        if (job.options.print_line_and_time) job.log << __LINE__ << "  " << job.timer.stop() << endl;
+        ArrayRGB reduced = reduced_format(format, x2, x3);
+        size_t reduced_bytes = size_t(reduced.nr) * reduced.nc * 3 * sizeof(float);
+        bool spill = banded && reduced_bytes > budget / 4;
+        if (spill)
+            job.log << "Reduced image of " << (reduced_bytes >> 20) << "MB exceeds -K budget, using temp files\n";
+        RowStore image_reduced(reduced, spill);
+        stream_reduce_with_margins(reader, job.options.edge_reflectance, x2, x3, image_reduced, compact.get());
+        if (job.options.print_line_and_time) job.log << __LINE__ << "  " << job.timer.stop() << endl;
+        report_memory(job, "reduce");
+        if (!banded)
+        {
+            ArrayRGB whole = image_reduced.take();
+            correction = field_from_reduced(whole, format, refl_area, job);
+        }
+        else
+        {
+            correction.image_nr = format.nr;
+            correction.image_nc = format.nc;
+            correction.image_dpi = format.dpi;
+            correction.reduction = format.dpi / refl_area.dpi;
+            correction.gamma = format.gamma;
+            correction.edge_reflectance = job.options.edge_reflectance;
+            correction.calibration_hash = interpolate.file_hash;
+            ArrayRGB field_format(reduced.nr - 2 * reduced.dpi, reduced.nc - 2 * reduced.dpi, reduced.dpi, reduced.from_16bits, reduced.gamma);
+            field.field_rows = std::make_unique<RowStore>(field_format, spill);
+            int halo = refl_area.nr - 1;
+            int field_band_rows = int(std::max<size_t>(16, budget / 4 / (size_t(reduced.nc) * 3 * sizeof(float) * 2)));
+            stream_reflected_light_estimate(image_reduced, refl_area, *field.field_rows, std::max(16, field_band_rows - halo));
+            report_memory(job, "estimate");
+        }
+        if (job.options.print_line_and_time) job.log << __LINE__ << "  " << job.timer.stop() << endl;
+        if (job.options.export_correction_field)
+        {
+            job.log << "Saving reflection estimate: " << field_file << "\n";
+            correction.write(field_file);
+        }
+    }
+
+    std::unique_ptr<NpyRowWriter> corrected_out;
+    if (job.options.save_intermediate_files)
+    {
+        job.log << "Saving Corrected Image: corrected.npy" << endl;
+        corrected_out = std::make_unique<NpyRowWriter>("corrected.npy", format.nr, format.nc);
+    }
+    BandSource source(reader, compact.get(), band_rows);
+    ArrayRGB band;
+    int next_row;
+
+    // -W, the largest of the R, G, and B values exceeded by only .01% of the pixels, as detected_white()
+    float white_scale = 1;
+    if (job.options.adjust_to_detected_white)
+    {
+        array<PercentileHistogram, 3> hist;
+        for (int pass = 0; pass < 2; pass++)
+        {
+            source.rewind();
+            next_row = 0;
+            while (read_corrected_band(source, band, next_row, field, interpolate.gain_adj, job.options) >= 0)
+            {
+                auto clk = [&hist, &band, pass](int color) {
+                    if (pass == 0)
+                        hist[color].clk(band.v[color].data(), band.v[color].size());
+                    else
+                        hist[color].clk_fine(band.v[color].data(), band.v[color].size());
+                };
+                auto c0 = std::async(launchType, clk, 0);
+                auto c1 = std::async(launchType, clk, 1);
+                auto c2 = std::async(launchType, clk, 2);
+                c0.get(); c1.get(); c2.get();
+                if (corrected_out)
+                    corrected_out->write(ArrayRGB(band));
+            }
+            corrected_out.reset();
+            if (pass == 0)
+                for (auto& x : hist)
+                    x.select(x.n() - (1 + x.n() / 10000));
+        }
+        white_scale = 1 / std::max({ hist[0].value(), hist[1].value(), hist[2].value(), 0.0f });
+        report_memory(job, "white");
+    }
+    if (job.options.print_line_and_time) job.log << __LINE__ << "  " << job.timer.stop() << endl;
+
+    ArrayRGB out_format = format;
+    set_output_format(out_format, job);
+
+    TiffRowWriter out(image_out.c_str(), out_format, job.options.profile_name);
+    source.rewind();
+    next_row = 0;
+    while (read_corrected_band(source, band, next_row, field, interpolate.gain_adj, job.options) >= 0)
+    {
+        if (corrected_out)
+            corrected_out->write(ArrayRGB(band));
+        if (job.options.adjust_to_detected_white)
+            band.scale(white_scale);
+        out.write(band);
+    }
+    out.close();
+    if (job.options.print_line_and_time) job.log << __LINE__ << "  " << job.timer.stop() << endl;
+    report_memory(job, "write");
+    return true;
+}
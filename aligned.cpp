@@ -0,0 +1,173 @@
+/*
+Copyright (c) <2020> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#include <algorithm>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+#include "aligned.h"
+
+namespace {
+
+constexpr std::size_t pool_min_bytes = 256 * 1024;     // smaller blocks go straight to operator new
+
+// Size classes are 4 steps per doubling so pages differing by a few rows share a class
+std::size_t size_class(std::size_t bytes)
+{
+    std::size_t high = pool_min_bytes;
+    while (high < bytes / 2)
+        high *= 2;
+    std::size_t step = high / 4;
+    return (bytes + step - 1) / step * step;
+}
+
+struct Block {
+    void* p;
+    std::size_t bytes;
+};
+
+struct Pool {
+    std::mutex m;
+    std::list<Block> kept;                          // freed blocks, oldest first
+    std::size_t kept_bytes = 0;
+    std::size_t limit = pool_default_limit;         // most bytes kept
+    std::unordered_map<void*, std::size_t> live;    // pooled blocks in use and their sizes
+    std::size_t live_bytes = 0;
+    std::size_t high_water = 0;                     // most live bytes since reset
+    PoolCounters counters;
+
+    void trim(std::size_t max_bytes)
+    {
+        while (kept_bytes > max_bytes)
+        {
+            ::operator delete(kept.front().p, std::align_val_t(simd_alignment));
+            kept_bytes -= kept.front().bytes;
+            kept.pop_front();
+            counters.released++;
+        }
+    }
+};
+
+// Never destroyed, static vectors may free their blocks after other statics are gone
+Pool& pool()
+{
+    static Pool* p = new Pool;
+    return *p;
+}
+
+}
+
+std::size_t pool_block_bytes(std::size_t bytes)
+{
+    return bytes < pool_min_bytes ? bytes : size_class(bytes);
+}
+
+void* pool_allocate(std::size_t bytes, std::size_t align)
+{
+    if (bytes < pool_min_bytes || align > simd_alignment)
+        return ::operator new(bytes, std::align_val_t(align));
+    std::size_t want = size_class(bytes);
+    Pool& p = pool();
+    std::lock_guard<std::mutex> lock(p.m);
+    p.counters.allocations++;
+
+    // smallest kept block that fits without wasting more than half the request
+    auto best = p.kept.end();
+    for (auto it = p.kept.begin(); it != p.kept.end(); ++it)
+        if (it->bytes >= want && it->bytes <= want + want / 2 && (best == p.kept.end() || it->bytes < best->bytes))
+            best = it;
+    Block b;
+    if (best != p.kept.end())
+    {
+        b = *best;
+        p.kept.erase(best);
+        p.kept_bytes -= b.bytes;
+        p.counters.reused++;
+        p.counters.bytes_reused += b.bytes;
+    }
+    else
+        b = { ::operator new(want, std::align_val_t(simd_alignment)), want };
+    try {
+        p.live.emplace(b.p, b.bytes);
+    }
+    catch (...) {
+        ::operator delete(b.p, std::align_val_t(simd_alignment));
+        throw;
+    }
+    p.live_bytes += b.bytes;
+    p.high_water = std::max(p.high_water, p.live_bytes);
+    return b.p;
+}
+
+void pool_free(void* ptr, std::size_t bytes, std::size_t align) noexcept
+{
+    if (ptr == nullptr)
+        return;
+    if (bytes < pool_min_bytes || align > simd_alignment)
+    {
+        ::operator delete(ptr, std::align_val_t(align));
+        return;
+    }
+    Pool& p = pool();
+    std::lock_guard<std::mutex> lock(p.m);
+    auto it = p.live.find(ptr);
+    Block b{ ptr, it->second };
+    p.live.erase(it);
+    p.live_bytes -= b.bytes;
+    try {
+        p.kept.push_back(b);
+        p.kept_bytes += b.bytes;
+    }
+    catch (...) {
+        ::operator delete(ptr, std::align_val_t(simd_alignment));
+    }
+    p.trim(p.limit);
+}
+
+void set_pool_limit(std::size_t bytes)
+{
+    Pool& p = pool();
+    std::lock_guard<std::mutex> lock(p.m);
+    p.limit = bytes;
+    p.trim(p.limit);
+}
+
+PoolCounters pool_counters()
+{
+    Pool& p = pool();
+    std::lock_guard<std::mutex> lock(p.m);
+    return p.counters;
+}
+
+PoolMemory pool_memory()
+{
+    Pool& p = pool();
+    std::lock_guard<std::mutex> lock(p.m);
+    return { p.live_bytes, p.kept_bytes, p.high_water };
+}
+
+void reset_pool_high_water()
+{
+    Pool& p = pool();
+    std::lock_guard<std::mutex> lock(p.m);
+    p.high_water = p.live_bytes;
+}
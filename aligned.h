@@ -0,0 +1,87 @@
+/*
+Copyright (c) <2020> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef ALIGNED_H
+#define ALIGNED_H
+
+#include <vector>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+
+// Image planes are allocated on cache line boundaries and image rows may be padded
+// to a multiple of 16 floats so vectorized kernels can use aligned loads on every row.
+constexpr std::size_t simd_alignment = 64;     // bytes, a cache line and one AVX-512 register
+constexpr int simd_row_floats = 16;            // floats per 64 bytes
+
+// Row pitch with padding, ncols rounded up to a multiple of 'multiple' elements
+inline int padded_pitch(int ncols, int multiple = simd_row_floats)
+{
+    return (ncols + multiple - 1) / multiple * multiple;
+}
+
+// Pool of freed image sized blocks. Successive pages and batch images allocate the
+// same plane, work buffer and field sizes, so freed blocks of 256KB or more are kept
+// and handed out again instead of going back to the OS and being page faulted in
+// again. Requests are rounded up to size classes of 4 per doubling and filled by the
+// smallest kept block up to 1.5 times the class. Kept blocks beyond the limit are
+// released oldest first. Thread safe, blocks may be freed by another thread.
+constexpr std::size_t pool_default_limit = std::size_t(1) << 30;
+void* pool_allocate(std::size_t bytes, std::size_t align);
+void pool_free(void* p, std::size_t bytes, std::size_t align) noexcept;
+void set_pool_limit(std::size_t bytes);     // most bytes kept for reuse, 0 to release all
+std::size_t pool_block_bytes(std::size_t bytes);    // bytes a request takes after rounding to its size class
+struct PoolCounters {
+    uint64_t allocations = 0;       // pooled size requests
+    uint64_t reused = 0;            // requests filled by a kept block, allocations avoided
+    uint64_t bytes_reused = 0;
+    uint64_t released = 0;          // kept blocks returned to the OS
+};
+PoolCounters pool_counters();
+
+// Bytes of pooled blocks in use, the most in use at once since reset_pool_high_water(),
+// and bytes kept for reuse. Buffers under 256KB aren't counted.
+struct PoolMemory {
+    std::size_t in_use = 0;
+    std::size_t kept = 0;
+    std::size_t high_water = 0;
+};
+PoolMemory pool_memory();
+void reset_pool_high_water();
+
+// Standard allocator returning memory aligned to Align bytes
+template <class T, std::size_t Align = simd_alignment>
+struct AlignedAllocator {
+    using value_type = T;
+    template <class U> struct rebind { using other = AlignedAllocator<U, Align>; };
+    AlignedAllocator() noexcept = default;
+    template <class U> AlignedAllocator(const AlignedAllocator<U, Align>&) noexcept {}
+    T* allocate(std::size_t n) { return static_cast<T*>(pool_allocate(n * sizeof(T), Align)); }
+    void deallocate(T* p, std::size_t n) noexcept { pool_free(p, n * sizeof(T), Align); }
+    template <class U> bool operator==(const AlignedAllocator<U, Align>&) const noexcept { return true; }
+    template <class U> bool operator!=(const AlignedAllocator<U, Align>&) const noexcept { return false; }
+};
+
+template <class T>
+using aligned_vector = std::vector<T, AlignedAllocator<T>>;
+
+#endif
@@ -7,7 +7,37 @@
 #include <cmath>
 #include <numeric>
 #include <algorithm>
+#include <type_traits>
+#include <cstddef>
+#include <future>
 #include "statistics.h"
+#include "aligned.h"
+
+template <class T>
+class Array2D;
+
+// Non-owning strided view of a rectangle of an Array2D, or of its transpose or rotation.
+// Elements are read (and written if T isn't const) in place, nothing is copied. The viewed
+// array must outlive the view and not be resized. to_array() makes an owning copy.
+template <class T>
+struct Array2DView {
+	using value_type = std::remove_const_t<T>;
+	T* data = nullptr;				// element (0, 0)
+	int nr = 0;
+	int nc = 0;
+	ptrdiff_t row_stride = 0;		// elements between rows
+	ptrdiff_t col_stride = 1;		// elements between columns, 1 unless transposed or rotated
+	T& operator()(int i, int j) const { return data[i * row_stride + j * col_stride]; }
+	Array2DView<T> sub(int rowstart, int rlen, int colstart, int clen) const
+	{
+		return { &(*this)(rowstart, colstart), rlen, clen, row_stride, col_stride };
+	}
+	template <class U = T, class = std::enable_if_t<!std::is_const_v<U>>>
+	operator Array2DView<const U>() const { return { data, nr, nc, row_stride, col_stride }; }
+	value_type ave() const;			// summed in the same order as Array2D::ave()
+	Array2D<value_type> to_array() const;
+	void copy_to(Array2DView<value_type> to, int first_row, int last_row) const;	// rows [first_row, last_row) of a same size view
+};
 
 // General 2D array suitable for working with single color or B&W images
 template <class T>
@@ -20,28 +50,39 @@ public:
 		int left;
 		int right;
 	};
-	std::vector<T> v;
+	aligned_vector<T> v;			// row major, nc elements per row, cache line aligned
 	int nc;
 	int nr;
-	Array2D(int NR = 0, int NC = 0) : v(NR* NC), nc(NC), nr(NR) {}
-	Array2D(int NR, int NC, T val) : v(NR* NC, val), nc(NC), nr(NR) {}
+	Array2D(int NR = 0, int NC = 0) : v(size_t(NR)* NC), nc(NC), nr(NR) {}
+	Array2D(int NR, int NC, T val) : v(size_t(NR)* NC, val), nc(NC), nr(NR) {}
 	Array2D(int NR, int NC, T* val, bool transpose);	// transposed=true to switch from col major to row major
 
 	// row and col access via [row][col] or (row,col)
-	T* operator[](int r) { return &v[r * nc]; }
-	const T* operator[](int r) const { return &v[r * nc]; }
-	T& operator()(int i, int j) { return v[i * nc + j]; }
-	const T& operator()(int i, int j) const { return v[i * nc + j]; }
+	T* operator[](int r) { return &v[size_t(r) * nc]; }
+	const T* operator[](int r) const { return &v[size_t(r) * nc]; }
+	T& operator()(int i, int j) { return v[size_t(i) * nc + j]; }
+	const T& operator()(int i, int j) const { return v[size_t(i) * nc + j]; }
+
+	// views of the whole array or of a subarray, no copy
+	Array2DView<T> view() { return { v.data(), nr, nc, nc, 1 }; }
+	Array2DView<const T> view() const { return { v.data(), nr, nc, nc, 1 }; }
+	Array2DView<T> view(int rowstart, int rlen, int colstart, int clen) { return view().sub(rowstart, rlen, colstart, clen); }
+	Array2DView<const T> view(int rowstart, int rlen, int colstart, int clen) const { return view().sub(rowstart, rlen, colstart, clen); }
+	Array2DView<const T> clip_view(Extants bounds) const		// view of clip(bounds)
+	{
+		return view(bounds.top, bounds.bottom - bounds.top + 1, bounds.left, bounds.right - bounds.left + 1);
+	}
+	operator Array2DView<const T>() const { return view(); }
 
 	// used to apply/remove gamma
 	void pow(float power) { std::transform(v.begin(), v.end(), v.begin(), [power](T x) {return std::pow(x, power); }); }
-	T ave() { return std::accumulate(v.begin(), v.end(), T{ 0 }) / v.size(); };
+	T ave() const { return std::accumulate(v.begin(), v.end(), T{ 0 }) / v.size(); };
 	void fill(T val) { std::generate(v.begin(), v.end(), [val]() { return val; }); }
 	
 	Array2D<T> clip(Extants bounds);	// clip array to new dimensions, ends of Extants are included
 	void scale(T factor) { std::transform(v.begin(), v.end(), v.begin(), [factor](T x) {return x * factor; }); }
 	Array2D<T> extract(int rowstart, int rlen, int colstart, int clen);	// extract subarray
-	void insert(const Array2D<T>& from, int start_row, int start_col);	// insert subarray
+	void insert(Array2DView<const T> from, int start_row, int start_col);	// insert subarray
 	void print(std::string filename, bool normalize = true) const;		// for debugging, print array as fixed text
 
 	// copy Array2D<float> to a fixed size 2D array<array>>
@@ -49,19 +90,75 @@ public:
 	std::array<std::array<float, N>, M> copy_to_array();
 };
 
+// Transposed views, no copy
 template<class T>
-Array2D<T> transpose(const Array2D<T>& x)
+Array2DView<T> transpose_view(Array2DView<T> x)
 {
-	Array2D<T> ret(x.nc, x.nr);
-	for (int row = 0; row < ret.nr; row++)
-		for (int col = 0; col < ret.nc; col++)
-			ret[row][col] = x[col][row];
+	return { x.data, x.nc, x.nr, x.col_stride, x.row_stride };
+}
+
+template<class T>
+Array2DView<const T> transpose_view(const Array2D<T>& x)
+{
+	return transpose_view(x.view());
+}
+
+// Views rotated clockwise by 0, 90, 180 or 270 degrees, no copy
+template<class T>
+Array2DView<T> rotate_view(Array2DView<T> x, int degrees)
+{
+	if (x.nr == 0 || x.nc == 0)
+		return degrees == 90 || degrees == 270 ? transpose_view(x) : x;
+	switch (degrees)
+	{
+	case 0:
+		return x;
+	case 90:	// top row becomes right column
+		return { &x(x.nr - 1, 0), x.nc, x.nr, x.col_stride, -x.row_stride };
+	case 180:
+		return { &x(x.nr - 1, x.nc - 1), x.nr, x.nc, -x.row_stride, -x.col_stride };
+	case 270:	// top row becomes left column
+		return { &x(0, x.nc - 1), x.nc, x.nr, -x.col_stride, x.row_stride };
+	}
+	throw "rotate_view, degrees must be 0, 90, 180, or 270";
+}
+
+template<class T>
+Array2DView<const T> rotate_view(const Array2D<T>& x, int degrees)
+{
+	return rotate_view(x.view(), degrees);
+}
+
+// Copy of a view, thirds of its rows copied on separate threads with the tiled copy of
+// Array2DView::copy_to(). policy is usually launchType from tiffresults.h
+template<class T>
+Array2D<T> copy_of(Array2DView<const T> from, std::launch policy)
+{
+	Array2D<T> ret(from.nr, from.nc);
+	auto band = [&from, &ret](int first, int last) { from.copy_to(ret.view(), first, last); };
+	auto c0 = std::async(policy, band, 0, ret.nr / 3);
+	auto c1 = std::async(policy, band, ret.nr / 3, 2 * ret.nr / 3);
+	auto c2 = std::async(policy, band, 2 * ret.nr / 3, ret.nr);
+	c0.get(); c1.get(); c2.get();
 	return ret;
 }
 
+// Copies rotated clockwise by 0, 90, 180 or 270 degrees, and transposed
+template<class T>
+Array2D<T> rotate(const Array2D<T>& x, int degrees, std::launch policy)
+{
+	return copy_of(rotate_view(x, degrees), policy);
+}
+
+template<class T>
+Array2D<T> transpose(const Array2D<T>& x, std::launch policy)
+{
+	return copy_of(transpose_view(x), policy);
+}
+
 // create from ptr to elements, with row/col major selection
 template<class T>
-Array2D<T>::Array2D(int NR, int NC, T* val, bool transpose) :v(NR* NC), nr(NR), nc(NC)
+Array2D<T>::Array2D(int NR, int NC, T* val, bool transpose) :v(size_t(NR)* NC), nr(NR), nc(NC)
 {
 	if (transpose)
 		for (int i = 0; i < NR; i++)
@@ -88,20 +185,61 @@ void Array2D<T>::print(std::string filename, bool normalize) const {
 }
 
 
+// Owning copy of the viewed elements
+template<class T>
+Array2D<typename Array2DView<T>::value_type> Array2DView<T>::to_array() const
+{
+	Array2D<value_type> ret(nr, nc);
+	copy_to(ret.view(), 0, nr);
+	return ret;
+}
+
+// Copy rows of this view into another. When the view's rows aren't contiguous, as in a
+// transpose or rotation, it's copied in 64x64 tiles so both the strided reads and the
+// row writes stay in cache. Separate row ranges may be copied on separate threads.
+template<class T>
+void Array2DView<T>::copy_to(Array2DView<value_type> to, int first_row, int last_row) const
+{
+	if (col_stride == 1 && to.col_stride == 1)
+	{
+		for (int i = first_row; i < last_row; i++)
+			std::copy(&(*this)(i, 0), &(*this)(i, 0) + nc, &to(i, 0));
+		return;
+	}
+	constexpr int tile = 64;
+	for (int i0 = first_row; i0 < last_row; i0 += tile)
+	{
+		int i1 = std::min(i0 + tile, last_row);
+		for (int j0 = 0; j0 < nc; j0 += tile)
+		{
+			int j1 = std::min(j0 + tile, nc);
+			for (int i = i0; i < i1; i++)
+				for (int j = j0; j < j1; j++)
+					to(i, j) = (*this)(i, j);
+		}
+	}
+}
+
+template<class T>
+typename Array2DView<T>::value_type Array2DView<T>::ave() const
+{
+	value_type sum{ 0 };
+	for (int i = 0; i < nr; i++)
+		for (int ii = 0; ii < nc; ii++)
+			sum = sum + (*this)(i, ii);
+	return sum / (size_t(nr) * nc);
+}
+
 // Extract a 2D array subset
 template<class T>
 Array2D<T> Array2D<T>::extract(int rowstart, int rlen, int colstart, int clen)
 {
-	Array2D ret(rlen, clen);
-	for (int i = 0; i < rlen; i++)
-		for (int ii = 0; ii < clen; ii++)
-			ret(i, ii) = (*this)(rowstart + i, colstart + ii);
-	return ret;
+	return view(rowstart, rlen, colstart, clen).to_array();
 }
 
 // Insert a 2D array into another 2D array
 template <class T>
-void Array2D<T>::insert(const Array2D<T>& from, int start_row, int start_col)
+void Array2D<T>::insert(Array2DView<const T> from, int start_row, int start_col)
 {
 	if (nr < from.nr + start_row || nc < from.nc + start_col)
 		throw "Array2D.insert, Out of bounds";
@@ -128,11 +266,7 @@ std::array<std::array<float, N>, M> Array2D<T>::copy_to_array()
 // Clip to subset as set in Extants
 template <typename T>
 Array2D<T> Array2D<T>::clip(Extants bounds) {
-	Array2D<T> ret(bounds.bottom - bounds.top + 1, bounds.right - bounds.left + 1);
-	for (int i = 0; i < ret.nr; i++)
-		for (int ii = 0; ii < ret.nc; ii++)
-			ret(i, ii) = (*this)(i + bounds.top, ii + bounds.left);
-	return ret;
+	return clip_view(bounds).to_array();
 }
 
 #endif
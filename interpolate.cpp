@@ -84,8 +84,20 @@ std::vector<std::vector<string>> tokenize_file(const std::string& filename)
 	return ret;
 }
 
+// FNV-1a hash of a file's bytes, used to tie saved results to a calibration file
+uint64_t hash_file(const std::string& filename)
+{
+	std::ifstream in(filename, ios::binary);
+	uint64_t hash = 14695981039346656037ull;
+	char buf[4096];
+	while (in.read(buf, sizeof(buf)) || in.gcount() > 0)
+		for (std::streamsize i = 0; i < in.gcount(); i++)
+			hash = (hash ^ static_cast<uint8_t>(buf[i])) * 1099511628211ull;
+	return hash;
+}
+
 // create interpolation matrix with dpi_out resolution
-Array2D<float> InterpolateRefl::get_interpolation_array(int dpi_out) {
+Array2D<float> InterpolateRefl::get_interpolation_array(int dpi_out) const {
 
 	// expand to requested out_dpi and adjust for overall reflectance
 	Array2D<float> ex = expand(adj, dpi_in, static_cast<float>(dpi_out));
@@ -128,6 +140,7 @@ bool InterpolateRefl::read_init_file(std::string filename, bool print) {
 			for (int ii = 0; ii < grid_size; ii++)
 				adj[i][ii]= std::stof(file_data[3+i][ii]);
 		gain_adj=adj.ave()*adj.nr*adj.nc;
+		file_hash = hash_file(filename);
 		if (print)
 			printf("Reflected light gain: %4.1f%%,  Gamma=%4.2f\n", 100.0f*gain_adj, gamma);
 	}
@@ -138,7 +151,7 @@ bool InterpolateRefl::read_init_file(std::string filename, bool print) {
 
 
 // https://en.wikipedia.org/wiki/Bilinear_interpolation
-Array2D<float> expand(Array2D<float>& adj, float dpi_in, float dpi_out)
+Array2D<float> expand(const Array2D<float>& adj, float dpi_in, float dpi_out)
 {
 	int new_dist = 1+2*int((dpi_out/dpi_in)*(adj.nc-1)/2+1);		// adj is odd sized square matrix where center is nominally 0,0
 	Array2D<float> ret(new_dist,new_dist);
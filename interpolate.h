@@ -32,6 +32,7 @@ SOFTWARE.
 #include <string>
 #include <iomanip>
 #include <numeric>
+#include <cstdint>
 #include "statistics.h"
 #include "array2d.h"
 
@@ -68,13 +69,17 @@ struct InterpolateRefl {
 	int grid_size{};
 	float dpi_in{};
 	float max_dist{1};			// 1" maximum range
+	uint64_t file_hash{};		// FNV-1a hash of calibration file bytes, identifies the calibration
 	bool read_init_file(std::string filename, bool print=false);	// initialize input file;
-	Array2D<float> get_interpolation_array(int dpi_out);
+	Array2D<float> get_interpolation_array(int dpi_out) const;
 };
 
-Array2D<float> expand(Array2D<float>& adj, float dpi_in, float dpi_out);
+Array2D<float> expand(const Array2D<float>& adj, float dpi_in, float dpi_out);
 Array2D<float>::Extants get_global_extants(const Array2D<float> &image);
 
+// FNV-1a hash of a file's bytes
+uint64_t hash_file(const std::string& filename);
+
 // tokenize a line and return vector of tokens, token may be quoted
 std::vector<std::string> parse(const std::string& s);
 
@@ -0,0 +1,115 @@
+/*
+Copyright (c) <2020> <doug gray>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+#ifndef PERCENTILE_H
+#define PERCENTILE_H
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+//----------------------- PercentileHistogram ----------------
+// Finds the value at a given rank in a large set of floats without sorting.
+// Non-negative IEEE floats sort the same as their bit patterns, so the upper
+// 16 bits select one of 65536 coarse bins and the lower 16 bits one of 65536
+// fine bins inside it. Pass 1 clocks in all data and select() locates the
+// coarse bin holding the rank, pass 2 clocks in the data again and only counts
+// values in that bin. value() is then exact, as if the data had been sorted.
+// Data may be clocked in any number of pieces (rows, strips, tiles) and pass 1
+// histograms from separate threads combined with +=. When a second pass isn't
+// possible estimate() interpolates within the coarse bin after select().
+// Negative values are treated as 0.
+class PercentileHistogram {
+private:
+    std::vector<uint64_t> coarse;   // counts indexed by upper 16 bits
+    std::vector<uint64_t> fine;     // counts indexed by lower 16 bits, selected coarse bin only
+    uint64_t count = 0;             // values clocked in pass 1
+    uint64_t rank = 0;              // ascending rank of requested value
+    uint64_t below = 0;             // values in coarse bins below selected bin
+    uint32_t bin = 0;               // selected coarse bin
+    static uint32_t key(float f) { uint32_t u; std::memcpy(&u, &f, sizeof(u)); return (u & 0x80000000u) ? 0 : u; }
+    static float from_key(uint32_t u) { float f; std::memcpy(&f, &u, sizeof(f)); return f; }
+public:
+    PercentileHistogram() : coarse(65536), fine(65536) {}
+    void clk(const float* p, size_t len);       // pass 1, clock in data
+    void clk_fine(const float* p, size_t len);  // pass 2, clock in the same data again
+    void select(uint64_t ascending_rank);       // locate coarse bin, required before pass 2
+    float value() const;                        // exact value at rank after pass 2
+    float estimate() const;                     // single pass value at rank, interpolated within bin
+    uint64_t n() const { return count; }
+    PercentileHistogram& operator+=(const PercentileHistogram& a);   // accumulate pass 1 histograms
+};
+
+inline void PercentileHistogram::clk(const float* p, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        coarse[key(p[i]) >> 16]++;
+    count += len;
+}
+
+inline void PercentileHistogram::clk_fine(const float* p, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        uint32_t k = key(p[i]);
+        if ((k >> 16) == bin)
+            fine[k & 0xffff]++;
+    }
+}
+
+inline void PercentileHistogram::select(uint64_t ascending_rank)
+{
+    rank = ascending_rank < count ? ascending_rank : (count == 0 ? 0 : count - 1);
+    below = 0;
+    for (bin = 0; bin < 65535 && below + coarse[bin] <= rank; bin++)
+        below += coarse[bin];
+    std::fill(fine.begin(), fine.end(), 0);
+}
+
+inline float PercentileHistogram::value() const
+{
+    uint64_t cum = below;
+    uint32_t i = 0;
+    for (; i < 65535 && cum + fine[i] <= rank; i++)
+        cum += fine[i];
+    return from_key(bin << 16 | i);
+}
+
+inline float PercentileHistogram::estimate() const
+{
+    float low = from_key(bin << 16);
+    float high = from_key(bin << 16 | 0xffff);
+    if (coarse[bin] == 0)
+        return low;
+    return low + (high - low) * static_cast<float>(rank - below) / coarse[bin];
+}
+
+inline PercentileHistogram& PercentileHistogram::operator+=(const PercentileHistogram& a)
+{
+    for (size_t i = 0; i < coarse.size(); i++)
+        coarse[i] += a.coarse[i];
+    count += a.count;
+    return *this;
+}
+//----------------------- PercentileHistogram  END ----------------
+#endif
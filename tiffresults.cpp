@@ -28,14 +28,22 @@ SOFTWARE.
 #include <fstream>
 #include <iostream>
 #include <algorithm>
+#include <cstring>
+#include <thread>
+#include <cstdio>
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#else
+#include <unistd.h>
+#endif
 #include "interpolate.h"
+#include "MappedFile.h"
+#include "ProcessCache.h"
 
 using std::vector;
 using std::array;
-using std::ios_base;
-using std::ios;
 using std::string;
-using std::ifstream;
 using std::tuple;
 
 ArrayRGB arrayRGBChangeDPI(const ArrayRGB& imag_in, int new_dpi)
@@ -54,69 +62,332 @@ ArrayRGB arrayRGBChangeDPI(const ArrayRGB& imag_in, int new_dpi)
     return imag_out;
 }
 
+// Rotated or transposed copy of each color plane on its own thread, context is kept
+template<class ViewOf>
+static ArrayRGB reorient(const ArrayRGB& x, ViewOf view_of)
+{
+    auto plane_of = [&x, view_of](int color) {
+        return view_of(Array2DView<const float>{ x.v[color].data(), x.nr, x.nc, x.pitch, 1 });
+    };
+    ArrayRGB ret(plane_of(0).nr, plane_of(0).nc, x.dpi, x.from_16bits, x.gamma);
+    ret.profile = x.profile;
+    ret.from_float = x.from_float;
+    ret.compression = x.compression;
+    auto plane = [&ret, plane_of](int color) {
+        plane_of(color).copy_to({ ret.v[color].data(), ret.nr, ret.nc, ret.pitch, 1 }, 0, ret.nr);
+    };
+    auto c0 = std::async(launchType, plane, 0);
+    auto c1 = std::async(launchType, plane, 1);
+    auto c2 = std::async(launchType, plane, 2);
+    c0.get(); c1.get(); c2.get();
+    return ret;
+}
 
+ArrayRGB rotate(const ArrayRGB& x, int degrees)
+{
+    return reorient(x, [degrees](Array2DView<const float> v) { return rotate_view(v, degrees); });
+}
 
-// Reads a tiff file and returns image in linear space (gamma=1) scaled 0-1
-ArrayRGB TiffRead(const char *filename, float gamma)
+ArrayRGB transpose(const ArrayRGB& x)
 {
-    ArrayRGB rgb;               // ArrayRGB to be returned
-    uint32 prof_size = 0;       // size of byte arrray for storing profile if present
-    uint8 *prof_data = nullptr; // ptr to byte array
-    uint16 bits;                // image was from 8 or 16 bit tiff
-    uint32 height;              // image pixe sizes
-    uint32 width;
-    uint32 size;                // width*height
-    uint16 planarconfig;        // pixel tiff storage orientation
-    float local_dpi;
+    return reorient(x, [](Array2DView<const float> v) { return transpose_view(v); });
+}
 
-    vector<uint32> image;
-    TIFF *tif;
+// Gamma lookup table for 8 or 16 bit samples, entry i is pow(i/max, gamma)
+static vector<float> gamma_lut(int bits, float gamma)
+{
+    int maxv = (1 << bits) - 1;
+    vector<float> lut(maxv + 1);
+    for (int i = 0; i <= maxv; i++)
+        lut[i] = pow(static_cast<float>(i) / maxv, gamma);
+    return lut;
+}
 
-    tif = TIFFOpen(filename, "r");
-    if (tif == 0)
+// Sample to linear float. Integer samples go through the gamma table, float samples are already linear
+static inline float to_linear(const vector<float>& lut, uint8 x) { return lut[x]; }
+static inline float to_linear(const vector<float>& lut, uint16 x) { return lut[x]; }
+static inline float to_linear(const vector<float>&, float x) { return x; }
+
+// Layout of the strips or tiles ("chunks") of a tif. Strips are handled as tiles
+// the full image width. Planar files store each sample in its own run of chunks,
+// only the first three (R, G, B) planes are read.
+struct ChunkLayout {
+    bool tiled;
+    bool planar;
+    uint32 image_nr, image_nc;          // image size in pixels
+    uint32 chunk_width, chunk_length;   // pixels
+    uint32 across, down, per_plane;     // chunks across and down the image, chunks per plane
+    uint16 nsamples;                    // samples per pixel
+    uint64 directory_offset;            // page of a multi-page tif
+    uint32 count() const { return planar ? 3 * per_plane : per_plane; }
+};
+
+static ChunkLayout chunk_layout(TIFF* tif, uint32 nr, uint32 nc, uint16 planarconfig, uint16 nsamples)
+{
+    ChunkLayout ret;
+    ret.directory_offset = TIFFCurrentDirOffset(tif);
+    ret.tiled = TIFFIsTiled(tif) != 0;
+    ret.planar = planarconfig == PLANARCONFIG_SEPARATE;
+    ret.nsamples = nsamples;
+    ret.image_nr = nr;
+    ret.image_nc = nc;
+    if (ret.tiled)
     {
-        return rgb;
+        TIFFGetField(tif, TIFFTAG_TILEWIDTH, &ret.chunk_width);
+        TIFFGetField(tif, TIFFTAG_TILELENGTH, &ret.chunk_length);
     }
-    TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bits);
-    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
-    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
-    TIFFGetField(tif, TIFFTAG_XRESOLUTION, &local_dpi);       // assume Xand Y the same
-    TIFFGetField(tif, TIFFTAG_ICCPROFILE, &prof_size, &prof_data);
-    TIFFGetField(tif, TIFFTAG_PLANARCONFIG, &planarconfig);
-    if (prof_size!=0)
+    else
     {
-        rgb.profile.resize(prof_size);
-        memcpy(rgb.profile.data(), prof_data, prof_size);
-        
-        // code to extract ICC profiles
-        //FILE *fp=fopen("test.icm", "wb");
-        //fwrite(prof_data, 1, prof_size, fp);
-        //fclose(fp);
+        ret.chunk_width = nc;
+        ret.chunk_length = nr;
+        TIFFGetFieldDefaulted(tif, TIFFTAG_ROWSPERSTRIP, &ret.chunk_length);
+        ret.chunk_length = std::min<uint32>(ret.chunk_length, nr);
     }
+    ret.across = (nc + ret.chunk_width - 1) / ret.chunk_width;
+    ret.down = (nr + ret.chunk_length - 1) / ret.chunk_length;
+    ret.per_plane = ret.across * ret.down;
+    return ret;
+}
 
-    size = width*height;
-    rgb.resize(height, width);
-    rgb.nc = width;
-    rgb.nr = height;
-    rgb.dpi = (int)local_dpi;
+// Unpack one decoded chunk through lut into rgb's planes, which hold image rows from first_row on
+template<class T>
+static void unpack_chunk(const T* buf, uint32 chunk, ArrayRGB& rgb, size_t first_row, const vector<float>& lut, const ChunkLayout& layout)
+{
+    size_t stride = layout.planar ? 1 : layout.nsamples;    // samples per pixel within a chunk
+    uint32 index = chunk % layout.per_plane;
+    size_t row0 = size_t(index / layout.across) * layout.chunk_length;
+    size_t col0 = size_t(index % layout.across) * layout.chunk_width;
+    size_t rows = std::min<size_t>(layout.chunk_length, layout.image_nr - row0);
+    size_t cols = std::min<size_t>(layout.chunk_width, layout.image_nc - col0);
+    for (size_t r = 0; r < rows; r++)
+    {
+        const T* in = &buf[r * layout.chunk_width * stride];
+        size_t offset = (row0 + r - first_row) * layout.image_nc + col0;
+        if (layout.planar)
+        {
+            float* out = &rgb.v[chunk / layout.per_plane][offset];
+            for (size_t c = 0; c < cols; c++)
+                out[c] = to_linear(lut, in[c]);
+        }
+        else
+        {
+            for (size_t c = 0; c < cols; c++, in += stride)
+            {
+                rgb.v[0][offset + c] = to_linear(lut, in[0]);
+                rgb.v[1][offset + c] = to_linear(lut, in[1]);
+                rgb.v[2][offset + c] = to_linear(lut, in[2]);
+            }
+        }
+    }
+}
+
+// Bytes of chunk actually used by unpack_chunk
+static uint64 chunk_bytes(uint32 chunk, const ChunkLayout& layout, int sample_bytes)
+{
+    size_t row0 = size_t((chunk % layout.per_plane) / layout.across) * layout.chunk_length;
+    size_t rows = std::min<size_t>(layout.chunk_length, layout.image_nr - row0);
+    return uint64(rows) * layout.chunk_width * (layout.planar ? 1 : layout.nsamples) * sample_bytes;
+}
+
+// Offsets of the chunks if they can be used in place: uncompressed, native byte order,
+// aligned and inside the file. Empty if not.
+static vector<uint64> mapped_chunk_offsets(TIFF* tif, const MappedFile& mapped, const ChunkLayout& layout, int sample_bytes)
+{
+    uint16 compression = COMPRESSION_NONE;
+    TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION, &compression);
+    uint64* offsets = nullptr;
+    uint64* bytecounts = nullptr;
+    if (!mapped.is_open() || compression != COMPRESSION_NONE || (sample_bytes > 1 && TIFFIsByteSwapped(tif))
+        || !TIFFGetField(tif, layout.tiled ? TIFFTAG_TILEOFFSETS : TIFFTAG_STRIPOFFSETS, &offsets)
+        || !TIFFGetField(tif, layout.tiled ? TIFFTAG_TILEBYTECOUNTS : TIFFTAG_STRIPBYTECOUNTS, &bytecounts))
+        return {};
+    vector<uint64> ret(offsets, offsets + layout.count());
+    for (uint32 chunk = 0; chunk < layout.count(); chunk++)
+    {
+        uint64 need = chunk_bytes(chunk, layout, sample_bytes);
+        if (ret[chunk] % sample_bytes != 0 || bytecounts[chunk] < need || ret[chunk] + need > mapped.size())
+            return {};
+    }
+    return ret;
+}
+
+// Read handle through the mapping if the file could be mapped, empty if it can't be opened
+static TiffHandle open_tiff(const char* filename, const MappedFile& mapped)
+{
+    return TiffHandle(mapped.is_open() ? mapped.open_tiff(filename) : TIFFOpen(filename, "r"));
+}
+
+// Decodes chunks of an 8, 16 or 32 (float) bit RGB tif into ArrayRGB planes spread over the
+// available cores. Uncompressed chunks are unpacked in place from the mapping, others are
+// decompressed by libtiff with a TIFF handle per worker, kept open for following calls.
+class ChunkDecoder {
+    const char* filename;
+    const MappedFile& mapped;
+    ChunkLayout layout;
+    int bits;
+    vector<float> lut;
+    vector<uint64> offsets;     // in place chunk offsets, empty if decompressed
+    vector<TiffHandle> handles; // one per worker
+    template<class T>
+    void decode_part(ArrayRGB& rgb, size_t first_row, const vector<uint32>& chunks, size_t first, size_t last, TIFF* tif);
+public:
+    ChunkDecoder(const char* filename, const MappedFile& mapped, TIFF* tif, const ChunkLayout& layout, int bits, float gamma);
+    ChunkDecoder(const ChunkDecoder&) = delete;
+    ChunkDecoder& operator=(const ChunkDecoder&) = delete;
+    const ChunkLayout& chunk_layout() const { return layout; }
+    vector<uint32> row_of_chunks(uint32 first_down, uint32 last_down) const;  // chunks in rows of chunks [first_down, last_down)
+    void decode(ArrayRGB& rgb, size_t first_row, const vector<uint32>& chunks);
+};
+
+ChunkDecoder::ChunkDecoder(const char* filename, const MappedFile& mapped, TIFF* tif, const ChunkLayout& layout, int bits, float gamma)
+    : filename(filename), mapped(mapped), layout(layout), bits(bits)
+{
+    if (bits != 32)
+        lut = gamma_lut(bits, gamma);
+    offsets = mapped_chunk_offsets(tif, mapped, layout, bits / 8);
+    if (!offsets.empty())
+        mapped.advise_sequential();
+}
+
+vector<uint32> ChunkDecoder::row_of_chunks(uint32 first_down, uint32 last_down) const
+{
+    vector<uint32> ret;
+    for (uint32 plane = 0; plane < (layout.planar ? 3u : 1u); plane++)
+        for (uint32 i = first_down * layout.across; i < last_down * layout.across; i++)
+            ret.push_back(plane * layout.per_plane + i);
+    return ret;
+}
+
+template<class T>
+void ChunkDecoder::decode_part(ArrayRGB& rgb, size_t first_row, const vector<uint32>& chunks, size_t first, size_t last, TIFF* tif)
+{
+    if (!offsets.empty())
+    {
+        for (size_t i = first; i < last; i++)
+        {
+            if (i + 1 < last)
+                mapped.prefetch(offsets[chunks[i + 1]], chunk_bytes(chunks[i + 1], layout, sizeof(T)));
+            unpack_chunk(reinterpret_cast<const T*>(mapped.data() + offsets[chunks[i]]), chunks[i], rgb, first_row, lut, layout);
+        }
+        return;
+    }
+    vector<T> buf((layout.tiled ? TIFFTileSize(tif) : TIFFStripSize(tif)) / sizeof(T));
+    for (size_t i = first; i < last; i++)
+    {
+        tmsize_t status = layout.tiled ? TIFFReadEncodedTile(tif, chunks[i], buf.data(), buf.size() * sizeof(T))
+            : TIFFReadEncodedStrip(tif, chunks[i], buf.data(), buf.size() * sizeof(T));
+        if (status < 0)
+            throw layout.tiled ? "Bad TIFFReadEncodedTile" : "Bad TIFFReadEncodedStrip";
+        unpack_chunk(buf.data(), chunks[i], rgb, first_row, lut, layout);
+    }
+}
+
+void ChunkDecoder::decode(ArrayRGB& rgb, size_t first_row, const vector<uint32>& chunks)
+{
+    size_t workers = std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(), chunks.size()));
+    while (offsets.empty() && handles.size() < workers)
+    {
+        TiffHandle tif = open_tiff(filename, mapped);
+        if (!tif)
+            throw "Bad TIFFOpen";
+        if (TIFFCurrentDirOffset(tif.get()) != layout.directory_offset && !TIFFSetSubDirectory(tif.get(), layout.directory_offset))
+            throw "Bad TIFFSetSubDirectory";
+        handles.push_back(std::move(tif));
+    }
+    vector<std::future<void>> parts;
+    for (size_t i = 0; i < workers; i++)
+    {
+        size_t first = chunks.size() * i / workers;
+        size_t last = chunks.size() * (i + 1) / workers;
+        TIFF* tif = offsets.empty() ? handles[i].get() : nullptr;
+        if (bits == 32)
+            parts.push_back(std::async(launchType, &ChunkDecoder::decode_part<float>, this, std::ref(rgb), first_row, std::cref(chunks), first, last, tif));
+        else if (bits == 16)
+            parts.push_back(std::async(launchType, &ChunkDecoder::decode_part<uint16>, this, std::ref(rgb), first_row, std::cref(chunks), first, last, tif));
+        else
+            parts.push_back(std::async(launchType, &ChunkDecoder::decode_part<uint8>, this, std::ref(rgb), first_row, std::cref(chunks), first, last, tif));
+    }
+    for (auto& part : parts)
+        part.get();
+}
+
+static TifInfo tif_info(TIFF* tif)
+{
+    TifInfo ret;
+    uint32 prof_size = 0;       // size of byte arrray for storing profile if present
+    uint8 *prof_data = nullptr; // ptr to byte array
+    TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &ret.bits);
+    TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &ret.width);
+    TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &ret.height);
+    TIFFGetField(tif, TIFFTAG_XRESOLUTION, &ret.dpi);       // assume Xand Y the same
+    TIFFGetField(tif, TIFFTAG_ICCPROFILE, &prof_size, &prof_data);
+    TIFFGetField(tif, TIFFTAG_PLANARCONFIG, &ret.planarconfig);
+    TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &ret.nsamples);
+    TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &ret.photometric);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_ORIENTATION, &ret.orientation);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_COMPRESSION, &ret.compression);
+    TIFFGetFieldDefaulted(tif, TIFFTAG_SAMPLEFORMAT, &ret.sampleformat);
+    if (prof_size != 0)
+        ret.profile.assign(prof_data, prof_data + prof_size);
+    return ret;
+}
+
+// ArrayRGB with the size and context of the page but no pixels
+ArrayRGB TiffFormat(const TifInfo& info, float gamma)
+{
+    ArrayRGB rgb;
+    rgb.nc = info.width;
+    rgb.nr = info.height;
+    rgb.pitch = rgb.nc;
+    rgb.dpi = (int)info.dpi;
     rgb.gamma = gamma;
-    if (planarconfig != PLANARCONFIG_CONTIG || bits == 8) {
-        if (bits == 16)
-            std::cout << "16 bit tif file not recognized, reverting to 8 bit read.\n";
-        rgb.from_16bits = false;
-        image.resize(height*width);
+    rgb.compression = info.compression;
+    rgb.profile = info.profile;
+    rgb.from_16bits = info.native() && info.bits == 16;
+    rgb.from_float = info.native() && info.bits == 32;
+    return rgb;
+}
+
+// Headers of every page, read with one open by following the chain of directories
+vector<TifInfo> TiffPages(const char* filename)
+{
+    vector<TifInfo> ret;
+    MappedFile mapped(filename);
+    TiffHandle tif = open_tiff(filename, mapped);
+    if (!tif)
+        return ret;
+    do
+    {
+        ret.push_back(tif_info(tif.get()));
+        ret.back().offset = TIFFCurrentDirOffset(tif.get());
+    } while (TIFFReadDirectory(tif.get()));
+    return ret;
+}
+
+// Decode the current page of tif, described by info, into linear space (gamma=1) scaled 0-1
+static ArrayRGB read_page(const char* filename, const MappedFile& mapped, TIFF* tif, const TifInfo& info, float gamma)
+{
+    ArrayRGB rgb;               // ArrayRGB to be returned
+    vector<uint32> image;
+    uint32 height = info.height;
+    uint32 width = info.width;
+    rgb = TiffFormat(info, gamma);
+    rgb.resize(height, width);
+
+    if (!info.native()) {
+        vector<float> lut = gamma_lut(8, gamma);
+        image.resize(size_t(height)*width);
         int istatus = TIFFReadRGBAImage(tif, width, height, image.data());
         if (istatus==1) {
-            for (uint32 c = 0; c < width; c++)
+            for (uint32 r = 0; r < height; r++)
             {
-                for (uint32 r = 0; r < height; r++)
+                const uint32* z = &image[size_t(height - r - 1) * width];  // RGBA raster is bottom up
+                size_t offset = size_t(r) * width;
+                for (uint32 c = 0; c < width; c++)
                 {
-                    int yt = height-r-1;
-                    //auto z0 = this->operator[](yt)[c];
-                    uint32 z0 = image[yt*width+c];
-                    rgb(r, c, 0) = pow(static_cast<float>(z0 & 0xff)/255, gamma);
-                    rgb(r, c, 1) = pow(static_cast<float>((z0>>8) & 0xff)/255, gamma);
-                    rgb(r, c, 2) = pow(static_cast<float>((z0>>16) & 0xff)/255, gamma);
+                    rgb.v[0][offset + c] = lut[z[c] & 0xff];
+                    rgb.v[1][offset + c] = lut[(z[c] >> 8) & 0xff];
+                    rgb.v[2][offset + c] = lut[(z[c] >> 16) & 0xff];
                 }
             }
         }
@@ -125,48 +396,83 @@ ArrayRGB TiffRead(const char *filename, float gamma)
     }
     else
     {
-        rgb.from_16bits = true;
-        uint32 row, col;
-        uint16 config, nsamples;
-
-        TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
-        TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
-        TIFFGetField(tif, TIFFTAG_PLANARCONFIG, &config);
-        TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &nsamples);
-        vector<uint16_t> bufs(TIFFScanlineSize(tif));
-        if (config == PLANARCONFIG_CONTIG) {
-            for (row = 0; row < height; row++)
-            {
-                tmsize_t count = TIFFReadScanline(tif, bufs.data(), row);
-                for (col = 0; col < width; col++)
-                {
-                    rgb(row, col, 0) = pow(1.0f*bufs[col*nsamples + 0]/65535, gamma);
-                    rgb(row, col, 1) = pow(1.0f*bufs[col*nsamples + 1] / 65535, gamma);
-                    rgb(row, col, 2) = pow(1.0f*bufs[col*nsamples + 2] / 65535, gamma);
-                }
-            }
-        }
-        else
-            throw "16 bit file type not supported";
+        ChunkLayout layout = chunk_layout(tif, height, width, info.planarconfig, info.nsamples);
+        ChunkDecoder decoder(filename, mapped, tif, layout, info.bits, gamma);
+        decoder.decode(rgb, 0, decoder.row_of_chunks(0, layout.down));
     }
     return rgb;
 }
 
+// Reads the first page of a tiff file and returns image in linear space (gamma=1) scaled 0-1
+ArrayRGB TiffRead(const char *filename, float gamma)
+{
+    MappedFile mapped(filename);    // libtiff reads through the mapping when the file can be mapped
+    TiffHandle tif = open_tiff(filename, mapped);       // closed before the mapping on any exit
+    if (!tif)
+        return ArrayRGB();
+    TifInfo info = tif_info(tif.get());
+    if (info.read_as_8_bits())
+        std::cout << "16 bit tif file not recognized, reverting to 8 bit read.\n";
+    return read_page(filename, mapped, tif.get(), info, gamma);
+}
+
+// As above for a page from TiffPages(), read without walking the directories before it.
+// The caller has the page's header and reports read_as_8_bits() itself.
+ArrayRGB TiffRead(const char* filename, float gamma, const TifInfo& page)
+{
+    MappedFile mapped(filename);
+    TiffHandle tif = open_tiff(filename, mapped);
+    if (!tif || (TIFFCurrentDirOffset(tif.get()) != page.offset && !TIFFSetSubDirectory(tif.get(), page.offset)))
+        return ArrayRGB();
+    return read_page(filename, mapped, tif.get(), page, gamma);
+}
+
+TiffRowReader::TiffRowReader(const char* filename, float gamma) : mapped(filename), tif(open_tiff(filename, mapped))
+{
+    if (!tif)
+        return;
+    TifInfo info = tif_info(tif.get());
+    fmt = TiffFormat(info, gamma);
+    if (!info.native())
+        return;
+    ChunkLayout layout = chunk_layout(tif.get(), info.height, info.width, info.planarconfig, info.nsamples);
+    decoder = std::make_unique<ChunkDecoder>(filename, mapped, tif.get(), layout, info.bits, gamma);
+    chunk_rows_per_band = std::max<uint32>(1, 64 / layout.chunk_length);
+}
+
+void TiffRowReader::set_band_rows(int rows)
+{
+    if (decoder)
+        chunk_rows_per_band = std::max<uint32>(1, rows / decoder->chunk_layout().chunk_length);
+}
+
+TiffRowReader::~TiffRowReader() = default;    // decoder's handles close before tif and the mapping
+
+int TiffRowReader::read(ArrayRGB& band)
+{
+    const ChunkLayout& layout = decoder->chunk_layout();
+    if (next_down >= layout.down)
+        return 0;
+    uint32 last_down = std::min(layout.down, next_down + chunk_rows_per_band);
+    int first_row = next_down * layout.chunk_length;
+    int rows = std::min<int>(last_down * layout.chunk_length, fmt.nr) - first_row;
+    band.resize(rows, fmt.nc);
+    band.dpi = fmt.dpi;
+    band.gamma = fmt.gamma;
+    band.from_16bits = fmt.from_16bits;
+    band.from_float = fmt.from_float;
+    decoder->decode(band, first_row, decoder->row_of_chunks(next_down, last_down));
+    next_down = last_down;
+    return rows;
+}
+
 void attach_profile(const std::string & profile, TIFF * out, const ArrayRGB & rgb)
 {
-    // If profile is requested, read the profile file and store it in tiff image.
+    // If profile is requested, store the profile file in tiff image, read once per process.
     if (profile != "")
     {
-        ifstream profilestream(profile, ios::binary);
-        if (profilestream.fail())
-            throw "File could not be opened";
-        vector<char>  profileimage;
-        profilestream.seekg(0, ios_base::end);
-        size_t size = (size_t)profilestream.tellg();
-        profilestream.seekg(0, ios_base::beg);
-        profileimage.resize(size);
-        profilestream.read(profileimage.data(), size);
-        TIFFSetField(out, TIFFTAG_ICCPROFILE, (uint32)size, profileimage.data());
+        auto profileimage = cached_file_bytes(profile);
+        TIFFSetField(out, TIFFTAG_ICCPROFILE, (uint32)profileimage->size(), profileimage->data());
     }
     // rgb image already has a profile save it to new tiff
     else if (rgb.profile.size() != 0)
@@ -197,106 +503,494 @@ void TiffWrite(const char* file, const Array2D<std::array<float,3>> rgb, const s
     TiffWrite(file, rgb3, profile);
 }
 
-void TiffWrite(const char *file, const ArrayRGB &rgb, const string &profile)
+// Exact table driven replacement for static_cast<uint16>(pow(clamp(x, 0, 1), igamma) * 65535).
+// thresholds[k] is the smallest float that encodes to k. bin_code, indexed by the
+// upper bits of x, gives the code at the start of x's bin and the one or two
+// thresholds inside the bin are then checked, so no pow() is needed per sample.
+class Encode16 {
+    float igamma;
+    std::vector<uint16> bin_code;   // code at start of bin, bin is float bit pattern >> 12
+    std::vector<float> thresholds;  // 65536 entries, thresholds[0] unused
+    static float from_bits(uint32 u) { float f; memcpy(&f, &u, sizeof(f)); return f; }
+public:
+    explicit Encode16(float gamma) : igamma(1 / gamma), bin_code((0x3f800000 >> 12) + 1), thresholds(65536)
+    {
+        for (uint32 b = 0; b < bin_code.size(); b++)
+            bin_code[b] = direct(from_bits(b << 12));
+        for (int k = 1; k < 65536; k++)
+        {
+            float x = std::clamp(static_cast<float>(pow(k / 65535.0f, gamma)), 0.f, 1.f);
+            while (x > 0 && direct(std::nextafter(x, 0.f)) >= k)
+                x = std::nextafter(x, 0.f);
+            while (direct(x) < k)
+                x = std::nextafter(x, 2.f);
+            thresholds[k] = x;
+        }
+    }
+    uint16 direct(float x) const { return static_cast<uint16>(pow(std::clamp(x, 0.f, 1.f), igamma) * 65535); }
+    uint16 operator()(float x) const
+    {
+        if (!(x > 0.f && x < 1.f))
+            return direct(x);
+        uint32 u;
+        memcpy(&u, &x, sizeof(u));
+        uint32 code = bin_code[u >> 12];
+        uint32 next = bin_code[(u >> 12) + 1];
+        while (code < next && thresholds[code + 1] <= x)
+            code++;
+        return static_cast<uint16>(code);
+    }
+};
+
+// Quantize rows into interleaved samples with quantize_row(row, out), rows
+// spread over the available cores a block at a time, then write them in order
+// as image rows from first_row on.
+template<class T, class F>
+static void write_rows_parallel(TIFF* out, int first_row, int nr, int nc, F quantize_row)
+{
+    int workers = std::max(1, int(std::thread::hardware_concurrency()));
+    int block = 8 * workers;
+    size_t linesamples = size_t(3) * nc;
+    vector<T> buf(block * linesamples);
+    for (int row0 = 0; row0 < nr; row0 += block)
+    {
+        int rows = std::min(block, nr - row0);
+        auto part = [&buf, &quantize_row, linesamples, row0](int first, int last) {
+            for (int r = first; r < last; r++)
+                quantize_row(row0 + r, &buf[r * linesamples]);
+        };
+        vector<std::future<void>> parts;
+        for (int i = 0; i < workers; i++)
+            parts.push_back(std::async(launchType, part, rows * i / workers, rows * (i + 1) / workers));
+        for (auto& x : parts)
+            x.get();
+        for (int r = 0; r < rows; r++)
+            if (TIFFWriteScanline(out, &buf[r * linesamples], first_row + row0 + r, 0) < 0)
+                throw "Error writing tif";
+    }
+}
+
+static FILE* tif_stdout = nullptr;      // original stdout after reserve_stdout_for_tif()
+
+// Keep stdout for a "-" output tif and send everything else written to stdout,
+// including printf's, to stderr instead
+void reserve_stdout_for_tif()
+{
+    if (tif_stdout)
+        return;
+    fflush(stdout);
+#ifdef _WIN32
+    tif_stdout = _fdopen(_dup(_fileno(stdout)), "wb");
+    _dup2(_fileno(stderr), _fileno(stdout));
+#else
+    tif_stdout = fdopen(dup(fileno(stdout)), "wb");
+    dup2(fileno(stderr), fileno(stdout));
+#endif
+}
+
+// libtiff client procs for a TIFF held in a byte vector, used to compress strips on worker threads
+struct MemoryTiff {
+    vector<uint8> data;
+    toff_t pos = 0;
+    static tmsize_t read(thandle_t h, void* buf, tmsize_t size)
+    {
+        auto m = static_cast<MemoryTiff*>(h);
+        tmsize_t n = std::max<tmsize_t>(0, std::min<tmsize_t>(size, m->data.size() - std::min<size_t>(m->pos, m->data.size())));
+        if (n > 0)
+            memcpy(buf, m->data.data() + m->pos, n);
+        m->pos += n;
+        return n;
+    }
+    static tmsize_t write(thandle_t h, void* buf, tmsize_t size)
+    {
+        auto m = static_cast<MemoryTiff*>(h);
+        if (m->pos + size > m->data.size())
+            m->data.resize(m->pos + size);
+        memcpy(m->data.data() + m->pos, buf, size);
+        m->pos += size;
+        return size;
+    }
+    static toff_t seek(thandle_t h, toff_t off, int whence)
+    {
+        auto m = static_cast<MemoryTiff*>(h);
+        m->pos = whence == SEEK_SET ? off : whence == SEEK_CUR ? m->pos + off : m->data.size() + off;
+        return m->pos;
+    }
+    static int close(thandle_t) { return 0; }
+    static int close_to_stdout(thandle_t h)     // for a new'd MemoryTiff, the whole tif is written when closed
+    {
+        auto m = static_cast<MemoryTiff*>(h);
+        FILE* out = tif_stdout ? tif_stdout : stdout;
+#ifdef _WIN32
+        _setmode(_fileno(out), _O_BINARY);
+#endif
+        fflush(stdout);
+        bool ok = fwrite(m->data.data(), 1, m->data.size(), out) == m->data.size() && fflush(out) == 0;
+        delete m;
+        return ok ? 0 : -1;
+    }
+    static toff_t size(thandle_t h) { return static_cast<MemoryTiff*>(h)->data.size(); }
+    static int map(thandle_t, void**, toff_t*) { return 0; }
+    static void unmap(thandle_t, void*, toff_t) {}
+};
+
+// Tags shared by the output tif and the in memory tifs strips are compressed in
+static void set_strip_tags(TIFF* tif, int nr, int nc, int bits, uint16 compression, uint32 rows_per_strip)
+{
+    TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, nc);
+    TIFFSetField(tif, TIFFTAG_IMAGELENGTH, nr);
+    TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 3);
+    TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+    TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+    TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, bits);
+    if (bits == 32)
+        TIFFSetField(tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+    TIFFSetField(tif, TIFFTAG_COMPRESSION, compression);
+    TIFFSetField(tif, TIFFTAG_PREDICTOR, bits == 32 ? PREDICTOR_FLOATINGPOINT : PREDICTOR_HORIZONTAL);
+    TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, rows_per_strip);
+}
+
+// Quantize and compress strips [first, last) in a private in memory tif, returning the encoded bytes of each
+template<class T, class F>
+static vector<vector<uint8>> encode_strips(int nr, int nc, uint16 compression, uint32 rows_per_strip, uint32 first, uint32 last, const F& quantize_row)
+{
+    size_t linesamples = size_t(3) * nc;
+    int row0 = first * rows_per_strip;
+    int rows = std::min<int>((last - first) * rows_per_strip, nr - row0);
+    MemoryTiff mem;
+    TIFF* tif = TIFFClientOpen("memory", "w", &mem, MemoryTiff::read, MemoryTiff::write, MemoryTiff::seek,
+        MemoryTiff::close, MemoryTiff::size, MemoryTiff::map, MemoryTiff::unmap);
+    if (tif == 0)
+        throw "Error compressing tif";
+    set_strip_tags(tif, rows, nc, sizeof(T) * 8, compression, rows_per_strip);
+    vector<T> buf(rows_per_strip * linesamples);
+    for (uint32 strip = 0; strip < last - first; strip++)
+    {
+        int strip_rows = std::min<int>(rows_per_strip, rows - strip * rows_per_strip);
+        for (int r = 0; r < strip_rows; r++)
+            quantize_row(row0 + strip * rows_per_strip + r, &buf[r * linesamples]);
+        if (TIFFWriteEncodedStrip(tif, strip, buf.data(), strip_rows * linesamples * sizeof(T)) < 0)
+        {
+            TIFFClose(tif);
+            throw "Error compressing tif";
+        }
+    }
+    uint64* offsets = nullptr;
+    uint64* bytecounts = nullptr;
+    TIFFGetField(tif, TIFFTAG_STRIPOFFSETS, &offsets);
+    TIFFGetField(tif, TIFFTAG_STRIPBYTECOUNTS, &bytecounts);
+    vector<vector<uint8>> ret(last - first);
+    for (uint32 strip = 0; strip < last - first; strip++)
+        ret[strip].assign(mem.data.begin() + offsets[strip], mem.data.begin() + offsets[strip] + bytecounts[strip]);
+    TIFFClose(tif);
+    return ret;
+}
+
+// Strips are quantized and compressed a batch at a time across the available cores,
+// then written in order with TIFFWriteRawStrip as the image's strips from first_strip on
+template<class T, class F>
+static void write_strips_compressed(TIFF* out, uint32 first_strip, int nr, int nc, uint16 compression, uint32 rows_per_strip, F quantize_row)
+{
+    uint32 workers = std::max(1u, std::thread::hardware_concurrency());
+    uint32 per_worker = 4;
+    uint32 nstrips = (nr + rows_per_strip - 1) / rows_per_strip;
+    for (uint32 first = 0; first < nstrips; first += workers * per_worker)
+    {
+        vector<std::future<vector<vector<uint8>>>> parts;
+        for (uint32 s = first; s < std::min(nstrips, first + workers * per_worker); s += per_worker)
+            parts.push_back(std::async(launchType, encode_strips<T, F>, nr, nc, compression, rows_per_strip,
+                s, std::min(nstrips, s + per_worker), std::cref(quantize_row)));
+        uint32 strip = first_strip + first;
+        for (auto& part : parts)
+            for (auto& encoded : part.get())
+                if (TIFFWriteRawStrip(out, strip++, encoded.data(), encoded.size()) < 0)
+                    throw "Error writing tif";
+    }
+}
+
+// Supported output compression for a requested or input file's compression, others are written uncompressed
+static uint16 output_compression(uint16 compression)
+{
+    if (compression == COMPRESSION_DEFLATE)
+        compression = COMPRESSION_ADOBE_DEFLATE;
+    if (compression != COMPRESSION_LZW && compression != COMPRESSION_ADOBE_DEFLATE && compression != COMPRESSION_ZSTD)
+        return COMPRESSION_NONE;
+    return compression_available(compression) ? compression : COMPRESSION_NONE;
+}
+
+// Classic tifs use 32 bit file offsets. Switch to BigTIFF when the image data, allowing for
+// LZW's worst case expansion, and profile could come near 4GB. Multi-page files assume
+// all pages are the size of the first.
+static const char* tif_write_mode(const ArrayRGB& rgb, uint16 compression, int pages = 1)
+{
+    uint64 bytes = uint64(rgb.nr) * rgb.nc * 3 * (rgb.from_float ? 4 : rgb.from_16bits ? 2 : 1) * pages;
+    if (compression != COMPRESSION_NONE)
+        bytes += bytes / 2;
+    bytes += rgb.profile.size();
+    return bytes > 0xF0000000ull ? "w8" : "w";
+}
+
+// False only for LZW, deflate, or zstd when libtiff was built without the codec, the writers
+// then silently write uncompressed, set_output_format() reports it. Other codes are always
+// written uncompressed.
+bool compression_available(uint16 compression)
+{
+    if (compression == COMPRESSION_DEFLATE)
+        compression = COMPRESSION_ADOBE_DEFLATE;
+    if (compression != COMPRESSION_LZW && compression != COMPRESSION_ADOBE_DEFLATE && compression != COMPRESSION_ZSTD)
+        return true;
+    return TIFFIsCODECConfigured(compression) != 0;
+}
+
+uint16 compression_code(const std::string& name)
+{
+    if (name == "none")
+        return COMPRESSION_NONE;
+    if (name == "lzw")
+        return COMPRESSION_LZW;
+    if (name == "deflate" || name == "zip")
+        return COMPRESSION_ADOBE_DEFLATE;
+    if (name == "zstd")
+        return COMPRESSION_ZSTD;
+    return 0;
+}
+
+// Sets the tags of a page of out and encodes its pixels a band of rows at a time, top to
+// bottom. Bands other than the last must be a multiple of strip_rows() rows.
+// Uncompressed files keep the original one row scanline writes, compressed ones use
+// strips of about 256K so each compresses well and there are enough to share among cores
+class PageEncoder {
+    TIFF* out;
+    int nr, nc;                     // page size
+    int bits;                       // 8, 16, or 32 (float)
+    float igamma;
+    uint16 compression;
+    uint32 rows_per_strip = 1;      // compressed strips
+    std::unique_ptr<Encode16> table;
+    int next_row = 0;
+    template<class T, class F>
+    void write_rows(int nr_band, F quantize_row);
+public:
+    PageEncoder(TIFF* out, const ArrayRGB& format, const string& profile, uint16 compression);
+    int strip_rows() const { return compression == COMPRESSION_NONE ? 1 : rows_per_strip; }
+    void write(const ArrayRGB& band);
+};
+
+PageEncoder::PageEncoder(TIFF* out, const ArrayRGB& format, const string& profile, uint16 compression)
+    : out(out), nr(format.nr), nc(format.nc), bits(format.from_float ? 32 : format.from_16bits ? 16 : 8),
+      igamma(1 / format.gamma), compression(compression)
 {
-    float gamma = rgb.gamma;
     int sampleperpixel=3;
-    TIFF *out = TIFFOpen(file, "w");
-    TIFFSetField(out, TIFFTAG_IMAGEWIDTH, rgb.nc);  // set the width of the image
-    TIFFSetField(out, TIFFTAG_IMAGELENGTH, rgb.nr);    // set the height of the image
+    TIFFSetField(out, TIFFTAG_IMAGEWIDTH, nc);  // set the width of the image
+    TIFFSetField(out, TIFFTAG_IMAGELENGTH, nr);    // set the height of the image
     TIFFSetField(out, TIFFTAG_SAMPLESPERPIXEL, sampleperpixel);   // set number of channels per pixel
     TIFFSetField(out, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);    // set the origin of the image.
                                                                     //   Some other essential fields to set that you do not have to understand for now.
     TIFFSetField(out, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
     TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-    TIFFSetField(out, TIFFTAG_XRESOLUTION, (float)rgb.dpi);
-    TIFFSetField(out, TIFFTAG_YRESOLUTION, (float)rgb.dpi);
-    attach_profile(profile, out, rgb);
-    if (!rgb.from_16bits)
+    TIFFSetField(out, TIFFTAG_XRESOLUTION, (float)format.dpi);
+    TIFFSetField(out, TIFFTAG_YRESOLUTION, (float)format.dpi);
+    attach_profile(profile, out, format);
+    TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, bits);    // set the size of the channels
+    if (bits == 32)
+        TIFFSetField(out, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_IEEEFP);
+    // We set the strip size of the file to be size of one row of pixels
+    TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(out, nc*sampleperpixel));
+    if (compression != COMPRESSION_NONE)
+    {
+        rows_per_strip = std::max<uint32>(1, (1 << 18) / (3 * nc * (bits / 8)));
+        set_strip_tags(out, nr, nc, bits, compression, rows_per_strip);
+    }
+    // table costs about 500K pow() calls, only worth it for larger images
+    if (bits == 16 && size_t(nr) * nc > 1000000)
+        table = std::make_unique<Encode16>(format.gamma);
+}
+
+template<class T, class F>
+void PageEncoder::write_rows(int nr_band, F quantize_row)
+{
+    if (compression == COMPRESSION_NONE)
+        write_rows_parallel<T>(out, next_row, nr_band, nc, quantize_row);
+    else
+        write_strips_compressed<T>(out, next_row / rows_per_strip, nr_band, nc, compression, rows_per_strip, quantize_row);
+    next_row += nr_band;
+}
+
+void PageEncoder::write(const ArrayRGB& band)
+{
+    if (bits == 32)
+    {
+        // Linear values are written as is, no gamma encoding or clipping
+        auto row_to_float = [&band](int row, float* out_row) {
+            size_t offset = size_t(row) * band.nc;
+            for (int color = 0; color < 3; color++)
+                for (int c = 0; c < band.nc; c++)
+                    out_row[3 * c + color] = band.v[color][offset + c];
+        };
+        write_rows<float>(band.nr, row_to_float);
+    }
+    else if (bits == 8)
     {
-        TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 8);    // set the size of the channels
-        tsize_t linebytes = sampleperpixel * rgb.nc;
-        vector<unsigned char> buf(linebytes);
-
-        // We set the strip size of the file to be size of one row of pixels
-        TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(out, rgb.nc*sampleperpixel));
-        vector<array<uint8, 3>> image(rgb.nr*rgb.nc);
-        //unique_ptr<uint32[]> image(new uint32[rgb.nr*rgb.nc]);
-        auto igamma = 1 / gamma;
-        auto one_channel_to_8 = [](const vector<float> &image_ch, int cols, float inv_gamma) {
-            float resid = 0;
-            vector<uint8> ret(image_ch.size());
-            for (size_t i = 0; i < ret.size(); i++)
+        // Error diffusion residual is reset at the start of each row so rows are independent.
+        // The residual depends on full precision values so pow() is kept to stay bit exact.
+        float igamma = this->igamma;
+        auto row_to_8 = [&band, igamma](int row, uint8* out_row) {
+            for (int color = 0; color < 3; color++)
             {
-                if (i % cols == 0)    // No offset at start of each row
-                    resid = 0;
-                float tmp = 255 * pow(image_ch[i], inv_gamma);
-                if (tmp > 255) tmp = 255;
-                if (tmp < 0) tmp = 0;
-                uint8 tmpr = static_cast<uint8>(tmp + .5);
-                resid += tmp - tmpr;
-                if (resid > .5 && tmpr < 255)
+                const float* image_ch = &band.v[color][size_t(row) * band.nc];
+                float resid = 0;
+                for (int c = 0; c < band.nc; c++)
                 {
-                    resid -= 1;
-                    tmpr++;
+                    float tmp = 255 * pow(image_ch[c], igamma);
+                    if (tmp > 255) tmp = 255;
+                    if (tmp < 0) tmp = 0;
+                    uint8 tmpr = static_cast<uint8>(tmp + .5);
+                    resid += tmp - tmpr;
+                    if (resid > .5 && tmpr < 255)
+                    {
+                        resid -= 1;
+                        tmpr++;
+                    }
+                    else if (resid < -.5)
+                    {
+                        resid += 1;
+                        tmpr--;
+                    }
+                    out_row[3 * c + color] = tmpr;
                 }
-                else if (resid < -.5)
+            }
+        };
+        write_rows<uint8>(band.nr, row_to_8);
+    }
+    else
+    {
+        const Encode16* table = this->table.get();
+        float igamma = this->igamma;
+        auto row_to_16 = [&band, table, igamma](int row, uint16* out_row) {
+            size_t offset = size_t(row) * band.nc;
+            for (int color = 0; color < 3; color++)
+                for (int c = 0; c < band.nc; c++)
                 {
-                    resid += 1;
-                    tmpr--;
+                    float x = band.v[color][offset + c];
+                    out_row[3 * c + color] = table ? (*table)(x) : static_cast<uint16>(pow(std::clamp(x, 0.f, 1.f), igamma) * 65535);
                 }
-                ret[i] = tmpr;
-            }
-            return ret;
         };
-        vector<uint8> red = one_channel_to_8(rgb.v[0], rgb.nc, igamma);
-        vector<uint8> green = one_channel_to_8(rgb.v[1], rgb.nc, igamma);
-        vector<uint8> blue = one_channel_to_8(rgb.v[2], rgb.nc, igamma);
+        write_rows<uint16>(band.nr, row_to_16);
+    }
+}
 
-        for (int r = 0; r < rgb.nr; r++)
-            for (int c = 0; c < rgb.nc; c++)
-            {
-                int offset = r * rgb.nc + c;
-                //image[offset] = red[offset] | green[offset] << 8 | blue[offset] << 16 | 0xff000000;
-                image[offset][0] = red[offset];
-                image[offset][1] = green[offset];
-                image[offset][2] = blue[offset];
-            }
+// Write rgb as the current directory of out
+static void write_page(TIFF* out, const ArrayRGB& rgb, const string& profile, uint16 compression)
+{
+    PageEncoder(out, rgb, profile, compression).write(rgb);
+}
 
-        //Now writing image to the file one strip at a time
-        for (int row = 0; row < rgb.nr; row++)
-        {
-            //memcpy(buf, &image[row*linebytes/sizeof(uint32)], linebytes);    // check the index here, and figure out why not using h*linebytes
-            memcpy(buf.data(), &image[row*rgb.nc], linebytes);    // check the index here, and figure out why not using h*linebytes
-            if (TIFFWriteScanline(out, buf.data(), row, 0) < 0)
-                break;
-        }
+// Output tif, the file name "-" is stdout. Tifs are written with seeks so stdout's is built in memory
+static TIFF* open_output(const char* file, const char* mode)
+{
+    if (strcmp(file, "-") != 0)
+        return TIFFOpen(file, mode);
+    auto mem = new MemoryTiff;
+    TIFF* out = TIFFClientOpen("stdout", mode, mem, MemoryTiff::read, MemoryTiff::write, MemoryTiff::seek,
+        MemoryTiff::close_to_stdout, MemoryTiff::size, MemoryTiff::map, MemoryTiff::unmap);
+    if (out == 0)
+        delete mem;
+    return out;
+}
+
+void TiffWrite(const char *file, const ArrayRGB &rgb, const string &profile)
+{
+    uint16 compression = output_compression(rgb.compression);
+    TIFF *out = open_output(file, tif_write_mode(rgb, compression));
+    if (out == 0)
+        throw "Could not open output tif";
+    write_page(out, rgb, profile, compression);
+    TIFFClose(out);
+}
+
+TiffPageWriter::TiffPageWriter(const char* file, const ArrayRGB& first_page, int pages) : pages(pages)
+{
+    out = open_output(file, tif_write_mode(first_page, output_compression(first_page.compression), pages));
+    if (out == 0)
+        throw "Could not open output tif";
+}
+
+TiffPageWriter::~TiffPageWriter()
+{
+    if (out)
         TIFFClose(out);
-    }
-    else
-    {
-        TIFFSetField(out, TIFFTAG_BITSPERSAMPLE, 16);    // set the size of the channels
-        // 16  bit write
-        vector<array<uint16, 3>> buf(rgb.nc);
-        // We set the strip size of the file to be size of one row of pixels
-        TIFFSetField(out, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(out, rgb.nc*sampleperpixel));
+}
 
-        auto igamma = 1 / gamma;
+void TiffPageWriter::write(const ArrayRGB& rgb, const string& profile)
+{
+    TIFFSetField(out, TIFFTAG_SUBFILETYPE, FILETYPE_PAGE);
+    TIFFSetField(out, TIFFTAG_PAGENUMBER, written, pages);
+    write_page(out, rgb, profile, output_compression(rgb.compression));
+    if (!TIFFWriteDirectory(out))
+        throw "Error writing tif";
+    written++;
+}
 
-        for (int r = 0; r < rgb.nr; r++)
-        {
-            for (int c = 0; c < rgb.nc; c++)
-            {
-                for (int color = 0; color < 3; color++)
-                {
-                    buf[c][color] = static_cast<uint16>(pow(std::clamp(rgb(r, c, color), 0.f, 1.f), igamma) * 65535);
-                }
-            }
-            if (TIFFWriteScanline(out, buf.data(), r, 0) < 0)
-                throw "Error writing tif";
-        }
+void TiffPageWriter::close()
+{
+    TIFFClose(out);
+    out = nullptr;
+}
+
+TiffRowWriter::TiffRowWriter(const char* file, const ArrayRGB& format, const string& profile) : format(format)
+{
+    uint16 compression = output_compression(format.compression);
+    out = open_output(file, tif_write_mode(format, compression));
+    if (out == 0)
+        throw "Could not open output tif";
+    encoder = std::make_unique<PageEncoder>(out, format, profile, compression);
+    pending = format;
+    pending.resize(0, format.nc);
+}
+
+TiffRowWriter::~TiffRowWriter()
+{
+    encoder.reset();
+    if (out)
         TIFFClose(out);
+}
+
+void TiffRowWriter::write(const ArrayRGB& band)
+{
+    written += band.nr;
+    int strip_rows = encoder->strip_rows();
+    if (pending.nr == 0 && (band.nr % strip_rows == 0 || written == format.nr))
+    {
+        encoder->write(band);
+        return;
+    }
+    // hold rows until whole strips are available
+    for (auto& plane : pending.v)
+        plane.reserve(plane.size() + band.v[0].size());
+    for (int color = 0; color < 3; color++)
+        pending.v[color].insert(pending.v[color].end(), band.v[color].begin(), band.v[color].end());
+    pending.nr += band.nr;
+    int rows = written == format.nr ? pending.nr : pending.nr / strip_rows * strip_rows;
+    if (rows == 0)
+        return;
+    ArrayRGB whole(rows, pending.nc);
+    size_t samples = size_t(rows) * pending.nc;
+    for (int color = 0; color < 3; color++)
+    {
+        std::copy(pending.v[color].begin(), pending.v[color].begin() + samples, whole.v[color].begin());
+        pending.v[color].erase(pending.v[color].begin(), pending.v[color].begin() + samples);
     }
+    encoder->write(whole);
+    pending.nr -= rows;
+}
+
+void TiffRowWriter::close()
+{
+    if (written != format.nr)
+        throw "Incomplete tif written";
+    encoder.reset();
+    TIFFClose(out);
+    out = nullptr;
 }
 
 
@@ -321,16 +1015,29 @@ void ArrayRGB::copy(const ArrayRGB &from, int offsetx, int offsety)
 
 // note: re (row end) and ce (column end) are included, not one past
 ArrayRGB ArrayRGB::subArray(int rs, int re, int cs, int ce)
+{
+    return view(rs, re, cs, ce).to_array();
+}
+
+ArrayRGBView ArrayRGB::view(int rs, int re, int cs, int ce) const
 {
     if (!(rs <= re && re < nr) || !(cs <= ce && ce < nc))
         throw std::invalid_argument("copy with out of range arguments");
-    //assert(rs <= re && re < nr);
-    //assert(cs <= ce && ce < nc);
-    ArrayRGB s(re-rs+1, ce-cs+1);
+    ArrayRGBView ret;
+    ret.nr = re - rs + 1;
+    ret.nc = ce - cs + 1;
     for (int color = 0; color < 3; color++)
-        for (int r = rs; r <= re; r++)
-            for (int c = cs; c <= ce; c++)
-                s(r-rs, c-cs, color) = (*this)(r, c, color);
+        ret.v[color] = { row(rs, color) + cs, ret.nr, ret.nc, pitch, 1 };
+    return ret;
+}
+
+ArrayRGB ArrayRGBView::to_array() const
+{
+    ArrayRGB s(nr, nc);
+    for (int color = 0; color < 3; color++)
+        for (int r = 0; r < nr; r++)
+            for (int c = 0; c < nc; c++)
+                s(r, c, color) = (*this)(r, c, color);
     return s;
 }
 
@@ -357,7 +1064,7 @@ void ArrayRGB::scale(float factor)    // scale all array values by factor
 
 #pragma optimize("t", on)
 // return std::make_tuple(ret, x2, x3);
-tuple<ArrayRGB, int, int> getReflArea(const int dpi, InterpolateRefl& interpolate, const int use_this_size_if_not_0)
+tuple<ArrayRGB, int, int> getReflArea(const int dpi, const InterpolateRefl& interpolate, const int use_this_size_if_not_0)
 {
     auto actual_dpi = !use_this_size_if_not_0 ? dpi : use_this_size_if_not_0;
     float gain = 1;
@@ -424,10 +1131,10 @@ Array2D<float> generate_reflected_light_estimate(const Array2D<float>& image_red
 #pragma optimize("",on)
 
 
-// Create interpolated re-reflected values from original
+// Convolve reduced image with reflection matrix, this is the first order reflected light.
 // remove 1" surround and set DPI at reduced resolution
 #pragma optimize("t",on)
-ArrayRGB generate_reflected_light_estimate(const ArrayRGB& image_reduced, const ArrayRGB& refl_area)
+ArrayRGB convolve_reflected_light(const ArrayRGB& image_reduced, const ArrayRGB& refl_area)
 {
 	ArrayRGB image_correction = ArrayRGB(image_reduced.nr - 2 * image_reduced.dpi,
 		image_reduced.nc - 2 * image_reduced.dpi,
@@ -436,21 +1143,24 @@ ArrayRGB generate_reflected_light_estimate(const ArrayRGB& image_reduced, const
 		image_reduced.gamma
 	);
 
+	// Each output row accumulates the kernel taps in the same j, jj order as a per pixel
+	// sum, so the innermost loop runs along contiguous rows and vectorizes
 	auto fix = [&image_reduced, &refl_area, &image_correction](int s_row, int e_row, int color) {
+		const int nc = image_reduced.nc - refl_area.nc + 1;
 		for (int i = s_row; i < e_row; i++)
 		{
-			for (int ii = 0; ii < image_reduced.nc - refl_area.nc + 1; ii++)
+			float* out = image_correction.row(i, color);   // zero filled
+			for (int j = 0; j < refl_area.nr; j++)
 			{
-				float sum = 0;
-				for (int j = 0; j < refl_area.nr; j++)
+				const float* in = image_reduced.row(i + j, color);
+				const float* k = refl_area.row(j, color);
+				for (int jj = 0; jj < refl_area.nc; jj++)
 				{
-					for (int jj = 0; jj < refl_area.nc; jj++)
-					{
-						sum += image_reduced(i + j, ii + jj, color)*refl_area(j, jj, color);
-					}
+					const float* src = in + jj;
+					const float tap = k[jj];
+					for (int ii = 0; ii < nc; ii++)
+						out[ii] += src[ii] * tap;
 				}
-                // second order effect (reflections of reflections) included
-                image_correction(i, ii, color) = exp(sum)-1;
 			}
 		}
 	};
@@ -461,3 +1171,17 @@ ArrayRGB generate_reflected_light_estimate(const ArrayRGB& image_reduced, const
 	return image_correction;
 }
 #pragma optimize("",on)
+
+// Create interpolated re-reflected values from original
+// remove 1" surround and set DPI at reduced resolution
+ArrayRGB generate_reflected_light_estimate(const ArrayRGB& image_reduced, const ArrayRGB& refl_area)
+{
+	ArrayRGB image_correction = convolve_reflected_light(image_reduced, refl_area);
+	for (auto& plane : image_correction.v)
+		for (auto& x : plane)
+		{
+			float sum = x;
+			x = exp(sum)-1;		// second order effect (reflections of reflections) included
+		}
+	return image_correction;
+}
@@ -37,7 +37,34 @@ SOFTWARE.
 #include <cmath>
 #include <numeric>
 #include <future>
+#include <memory>
 #include "interpolate.h"
+#include "MappedFile.h"
+#include "aligned.h"
+
+// Header fields of a tif page, those TiffRead and TiffRowReader need
+struct TifInfo {
+    uint16 bits = 8;            // 8, 16, or 32 (float)
+    uint16 sampleformat = SAMPLEFORMAT_UINT;
+    uint32 height = 0;          // image pixel sizes
+    uint32 width = 0;
+    uint16 planarconfig = PLANARCONFIG_CONTIG;  // pixel tiff storage orientation
+    uint16 nsamples = 3;        // samples per pixel
+    uint16 photometric = PHOTOMETRIC_RGB;
+    uint16 orientation = ORIENTATION_TOPLEFT;
+    uint16 compression = COMPRESSION_NONE;
+    float dpi = 0;
+    std::vector<uint8> profile; // empty if no profile
+    uint64 offset = 0;          // of the page's directory, set by TiffPages()
+    // RGB strips or tiles, contiguous or planar, are decoded directly, everything else goes through libtiff's RGBA conversion
+    bool native() const
+    {
+        return (planarconfig == PLANARCONFIG_CONTIG || planarconfig == PLANARCONFIG_SEPARATE) && photometric == PHOTOMETRIC_RGB
+            && orientation == ORIENTATION_TOPLEFT && ((sampleformat == SAMPLEFORMAT_UINT && ((bits == 8 && nsamples == 3) || (bits == 16 && nsamples >= 3)))
+                || (sampleformat == SAMPLEFORMAT_IEEEFP && bits == 32 && nsamples >= 3));
+    }
+    bool read_as_8_bits() const { return !native() && bits == 16; }    // 16 bit page libtiff's RGBA conversion reduces
+};
 
 // Utility Functions
 class ArrayRGB;
@@ -46,10 +73,19 @@ void TiffWrite(const char *file, const ArrayRGB &rgb, const std::string &profile
 void TiffWrite(const char* file, const Array2D<float> rgb);
 void TiffWrite(const char* file, const Array2D<std::array<float, 3>> rgb, const std::string& profile);
 ArrayRGB TiffRead(const char *filename, float gamma);
-std::tuple<ArrayRGB, int, int> getReflArea(const int dpi, InterpolateRefl& interpolate, const int use_this_size_if_not_0 = 0);
+ArrayRGB TiffRead(const char* filename, float gamma, const TifInfo& page);   // page from TiffPages()
+std::vector<TifInfo> TiffPages(const char* filename);  // header of each page from one open, empty if unreadable
+ArrayRGB TiffFormat(const TifInfo& page, float gamma); // size, dpi, bits, profile, etc. with no pixels
+void reserve_stdout_for_tif();      // "-" output file is stdout, other stdout output goes to stderr
+uint16 compression_code(const std::string& name);   // "none", "lzw", "deflate", or "zstd", 0 if unknown
+bool compression_available(uint16 compression);     // false if the writers would fall back to uncompressed
+std::tuple<ArrayRGB, int, int> getReflArea(const int dpi, const InterpolateRefl& interpolate, const int use_this_size_if_not_0 = 0);
+ArrayRGB convolve_reflected_light(const ArrayRGB& image_reduced, const ArrayRGB& refl_area);
 ArrayRGB generate_reflected_light_estimate(const ArrayRGB& image_reduced, const ArrayRGB& refl_area);
 Array2D<float> generate_reflected_light_estimate(const Array2D<float>& image_reduced, const std::array<std::array<float,93>,93>& refl_area, float fill=0);
 ArrayRGB arrayRGBChangeDPI(const ArrayRGB& imag_in, int new_dpi);
+ArrayRGB rotate(const ArrayRGB& x, int degrees);    // clockwise 0, 90, 180, or 270 degrees
+ArrayRGB transpose(const ArrayRGB& x);
 
 // uncomment to disable multi-threading of R,G, and B color channels
 //#define DISABLE_ASYNC_THREADS
@@ -59,31 +95,115 @@ static auto launchType = std::launch::deferred;
 static auto launchType = std::launch::async;
 #endif
 
+// Non-owning view of a rectangle of an ArrayRGB's R, G, and B planes, see Array2DView.
+// to_array() makes an owning copy.
+struct ArrayRGBView {
+    Array2DView<const float> v[3];
+    int nr, nc;
+    float operator()(int r, int c, int color) const { return v[color](r, c); }
+    ArrayRGB to_array() const;
+};
+
 // Floating point RGB array representing an image including some context info
 // RGB values are stored in separate vectors since operations on each are independant
 // and so can be easily multi-threaded. Values are normally in gamma=1 and are [0:1]
+// Planes are cache line aligned. Rows are pitch floats apart, pitch is nc (packed) unless
+// resize() is given a padded pitch, see padded_pitch(). Code that walks a whole plane as
+// one vector (statistics, tif and npy writers) requires packed arrays, so padded arrays
+// are kept to work buffers inside the kernels.
 class ArrayRGB {
 public:
-    std::vector<float> v[3];			// separate vectors for each R, G, and B channels
+    aligned_vector<float> v[3];			// separate vectors for each R, G, and B channels
 	std::vector<uint8> profile;     // size is zero if no profile attached to image
     int dpi;
     int nc, nr;
+    int pitch;                      // floats between rows, >= nc
     float gamma;
     bool from_16bits;
+    bool from_float = false;                // 32 bit float linear tif, written back the same way
+    uint16 compression = COMPRESSION_NONE;  // tif compression of input file, used for output file
     ArrayRGB(int NR = 0, int NC = 0, int DPI=0, bool bits16=true, float gamma=1.7)
-        : nc(NC), nr(NR), dpi(DPI), from_16bits(bits16),
-          gamma(gamma) { for (auto& x:v) x.resize(NR*NC); }
-    void resize(int nrows, int ncols) { nr = nrows; nc = ncols; for (auto& x:v) x.resize(nc*nr); }
+        : dpi(DPI), nc(NC), nr(NR), pitch(NC), gamma(gamma),
+          from_16bits(bits16) { for (auto& x:v) x.resize(size_t(NR)*NC); }
+    void resize(int nrows, int ncols, int row_pitch = 0)  // row_pitch 0 is packed, existing pixels aren't moved
+    {
+        nr = nrows; nc = ncols; pitch = row_pitch ? row_pitch : ncols;
+        for (auto& x:v) { x.reserve(size_t(pitch)*nr); x.resize(size_t(pitch)*nr); }   // exact size, not grown geometrically
+    }
+    bool packed() const { return pitch == nc; }
+    float* row(int r, int color) { return &v[color][size_t(r)*pitch]; }
+    const float* row(int r, int color) const { return &v[color][size_t(r)*pitch]; }
     void fill(float red, float green, float blue);
     void copy(const ArrayRGB &from, int offsetx, int offsety);
     ArrayRGB subArray(int rs, int re, int cs, int ce);	// rs:row start, re: row end, etc.
+    ArrayRGBView view(int rs, int re, int cs, int ce) const;   // as subArray without a copy
     void copyColumn(int to, int from);
     void copyRow(int to, int from);
-	float& operator()(int r, int c, int color) { return v[color][r*nc+c]; };
-    float const & operator()(int r, int c, int color) const {return v[color][r*nc+c];}
+	float& operator()(int r, int c, int color) { return v[color][size_t(r)*pitch+c]; };
+    float const & operator()(int r, int c, int color) const {return v[color][size_t(r)*pitch+c];}
     void scale(float factor);    // scale all array values by factor
 };
 
+// libtiff handle closed when it goes out of scope, including by an exception
+struct TiffCloser {
+    void operator()(TIFF* tif) const { TIFFClose(tif); }
+};
+using TiffHandle = std::unique_ptr<TIFF, TiffCloser>;
+
+// Reads a tif a band of rows at a time so images larger than memory can be streamed.
+// Only the strips or tiles holding the rows of each band are decoded.
+class ChunkDecoder;
+class TiffRowReader {
+    MappedFile mapped;
+    TiffHandle tif;
+    ArrayRGB fmt;
+    std::unique_ptr<ChunkDecoder> decoder;
+    uint32 chunk_rows_per_band = 1;
+    uint32 next_down = 0;       // next row of strips or tiles
+public:
+    TiffRowReader(const char* filename, float gamma);
+    ~TiffRowReader();
+    TiffRowReader(const TiffRowReader&) = delete;
+    TiffRowReader& operator=(const TiffRowReader&) = delete;
+    bool streamable() const { return decoder != nullptr; }  // false if unreadable or needs libtiff's RGBA conversion
+    const ArrayRGB& format() const { return fmt; }          // image size, dpi, bits, profile, etc. with no pixels
+    int read(ArrayRGB& band);                               // next rows from the top, returns 0 after the last
+    void set_band_rows(int rows);                           // approximate rows per band, at least a row of strips or tiles
+    void rewind() { next_down = 0; }
+};
+
+// Writes a multi-page tif a page at a time, pages are written as TiffWrite would
+class TiffPageWriter {
+    TIFF* out = nullptr;
+    int pages;          // total pages, BigTIFF is chosen from first page size times pages
+    int written = 0;
+public:
+    TiffPageWriter(const char* file, const ArrayRGB& first_page, int pages);
+    ~TiffPageWriter();
+    TiffPageWriter(const TiffPageWriter&) = delete;
+    TiffPageWriter& operator=(const TiffPageWriter&) = delete;
+    void write(const ArrayRGB& rgb, const std::string& profile);
+    void close();
+};
+
+// Writes a single page tif a band of rows at a time, top to bottom, as TiffWrite
+// would write the whole image. Bands may be any number of rows.
+class PageEncoder;
+class TiffRowWriter {
+    TIFF* out = nullptr;
+    ArrayRGB format;
+    std::unique_ptr<PageEncoder> encoder;
+    ArrayRGB pending;           // rows waiting for a whole compressed strip
+    int written = 0;            // rows passed to write()
+public:
+    TiffRowWriter(const char* file, const ArrayRGB& format, const std::string& profile);
+    ~TiffRowWriter();
+    TiffRowWriter(const TiffRowWriter&) = delete;
+    TiffRowWriter& operator=(const TiffRowWriter&) = delete;
+    void write(const ArrayRGB& band);
+    void close();
+};
+
 // mod((6-1), 3) if not 0, subtract 3 for extra padding
 // This function is used to downsize the original image in multiples of 2 and/or 3
 // since high resolution is not needed for calculating extra light reflectance.
@@ -103,7 +223,8 @@ inline ArrayRGB downsample(const ArrayRGB &from, int rate)
 		return resid == 0 ? 0 : rate - resid;
 	};
 	auto xtra_r = xtra(from.nr, rate); auto xtra_c = xtra(from.nc, rate);
-	ArrayRGB fromEx(from.nr + 4 + xtra_r, from.nc + 4 + xtra_c);  // Expand sides by 2;
+	ArrayRGB fromEx;    // Expand sides by 2, work buffer so rows are padded
+	fromEx.resize(from.nr + 4 + xtra_r, from.nc + 4 + xtra_c, padded_pitch(from.nc + 4 + xtra_c));
 	fromEx.copy(from, 2, 2);
 
 	for (int i = 0; i < xtra_c; i++)    // duplicate last column(s)
@@ -135,19 +256,23 @@ inline ArrayRGB downsample(const ArrayRGB &from, int rate)
 	for (int color = 0; color <= 2; color++)
 	{
 		for (int x = 0; x < nr; x++) {            // interate over destination array
+			int xs = rate * x;
+			assert(xs + 4 < fromEx.nr);
+			assert(rate * (nc - 1) + 4 < fromEx.nc);
+			const float* rows[5];
+			for (int i = 0; i < 5; i++)
+				rows[i] = fromEx.row(xs + i, color);
+			float* out = ret.row(x, color);
 			for (int y = 0; y < nc; y++)
 			{
-				int xs = rate * x;
 				int ys = rate * y;
 				float prodsum = 0;
 				for (int i = 0; i < 5; i++) {
 					for (int j = 0; j < 5; j++) {
-						assert(xs + i < fromEx.nr);
-						assert(ys + j < fromEx.nc);
-						prodsum += smooth[i][j] * fromEx(xs + i, ys + j, color);
+						prodsum += smooth[i][j] * rows[i][ys + j];
 					}
 				}
-				ret(x, y, color) = prodsum;
+				out[y] = prodsum;
 			}
 		}
 	}
@@ -157,7 +282,7 @@ inline ArrayRGB downsample(const ArrayRGB &from, int rate)
 
 // This function is used to downsize a gray scale image by 2 or 3
 // since high resolution is not needed for calculating extra light reflectance.
-inline Array2D<float> downsample(const Array2D<float> &from, int rate)
+inline Array2D<float> downsample(Array2DView<const float> from, int rate)
 {
 	auto xtra = [](int rc, int rate) {  // calc needed extra row/col elements
 		auto resid = (rc - 1) % rate;
@@ -198,10 +323,9 @@ inline Array2D<float> downsample(const Array2D<float> &from, int rate)
 	return ret;
 }
 
-
 // f(0,0)(1-x)(1-y) +f(1,0)x(y-1)+f(0,1)(1-x)y + f(1,1)xy
 // https://en.wikipedia.org/wiki/Bilinear_interpolation
-inline float bilinear(ArrayRGB &correction, int r, int c, int reduction, int color)
+inline float bilinear(const ArrayRGB &correction, int r, int c, int reduction, int color)
 {
     auto r0 = r/reduction;
     auto r1 = r/reduction+1;